@@ -11,13 +11,21 @@
  * is retained. See LICENSE for details about MIT License.
  */
 
+#include <fcntl.h>
+#include <immintrin.h>
+#include <omp.h>
+#include <sched.h>
 #include <sys/mman.h>
 
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <chrono> 
 #include <iostream>
+#include <mutex>
 
 #include "BaseMeta.hpp"
+#include "ralloc.hpp"
 
 /*
  * BaseMeta.cpp contains implementation of most types and functions declared in
@@ -26,6 +34,18 @@
 using namespace std;
 using namespace ralloc;
 using namespace std::chrono;
+#ifdef SB_BITMAP
+// one checkpoint at a time
+static std::mutex ckpt_mtx;
+#endif
+// is_dirty found the heap dirty and has held dirty_mtx since; cleared once
+// recovered by set_dirty
+static bool dirty_found = false;
+// GC output, printed only at verbose level or higher
+#define GC_LOG(level, ...) do { if(ralloc::verbose >= (level)) printf(__VA_ARGS__); } while(0)
+static inline uint64_t us_since(high_resolution_clock::time_point start){
+    return duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+}
 template<class T, RegionIndex idx>
 CrossPtr<T,idx>::CrossPtr(T* real_ptr) noexcept{
     if(UNLIKELY(real_ptr == nullptr)){
@@ -152,6 +172,13 @@ void BaseMeta::set_dirty(){
     // this must be called AFTER is_dirty
     int s = pthread_mutex_trylock(&dirty_mtx);
     assert(s!=EOWNERDEAD&&"previous apps died! call is_dirty first!");
+    dirty_found = false;
+}
+
+void BaseMeta::hold_dirty(){
+    set_dirty();
+    pbuf_add(&dirty_mtx, sizeof(dirty_mtx));
+    pbuf_commit();
 }
 
 bool BaseMeta::is_dirty(){
@@ -159,6 +186,7 @@ bool BaseMeta::is_dirty(){
     switch(s){
     case EOWNERDEAD:
         pthread_mutex_consistent(&dirty_mtx);
+        dirty_found = true;
         return true;
     case 0:
         // succeeds
@@ -166,10 +194,13 @@ bool BaseMeta::is_dirty(){
         return false;
     case EBUSY:
     case EAGAIN:
-        return false;
+        // we may hold it since an earlier call found it dirty
+        return dirty_found;
     case EINVAL:
         pthread_mutex_destroy(&dirty_mtx);
         pthread_mutex_init(&dirty_mtx, &dirty_attr);
+        pthread_mutex_trylock(&dirty_mtx);
+        dirty_found = true;
         return true;
     default:
         printf("something unexpected happens when check dirty_mtx\n"); 
@@ -183,8 +214,16 @@ void BaseMeta::set_clean(){
 
 BaseMeta::BaseMeta() noexcept
 : 
+    xiaoxiang_gc(nullptr),
     avail_sb(),
-    heaps()
+    heaps(),
+    fresh_sb(0),
+#ifdef SB_BITMAP
+    ckpt_epoch(0),
+    ckpt_valid(0),
+    ckpt_leaky(false),
+#endif
+    layout(LAYOUT)
     // thread_num(thd_num) {
 {
     /* allocate these persistent data into specific memory address */
@@ -192,20 +231,27 @@ BaseMeta::BaseMeta() noexcept
     pthread_mutexattr_setrobust(&dirty_attr, PTHREAD_MUTEX_ROBUST);
     pthread_mutex_init(&dirty_mtx, &dirty_attr);
     set_dirty();
-    FLUSH(&dirty_attr);
-    FLUSH(&dirty_mtx);
+    pbuf_add(&dirty_attr, sizeof(dirty_attr));
+    pbuf_add(&dirty_mtx, sizeof(dirty_mtx));
+    pbuf_add(&fresh_sb, sizeof(fresh_sb));
+#ifdef SB_BITMAP
+    pbuf_add(&ckpt_epoch, sizeof(ckpt_epoch));
+    pbuf_add(&ckpt_valid, sizeof(ckpt_valid));
+    pbuf_add(&ckpt_leaky, sizeof(ckpt_leaky));
+#endif
+    pbuf_add(&layout, sizeof(layout));
     /* heaps init */
     for (size_t idx = 0; idx < MAX_SZ_IDX; ++idx){
         ProcHeap& heap = heaps[idx];
         heap.partial_list.store(nullptr);
         heap.sc_idx = idx;
-        FLUSH(&heaps[idx]);
+        pbuf_add(&heaps[idx], sizeof(ProcHeap));
     }
 
     /* persistent roots init */
     for(int i=0;i<MAX_ROOTS;i++){
         roots[i]=nullptr;
-        FLUSH(&roots[i]);
+        pbuf_add(&roots[i], sizeof(roots[i]));
     }
 
     // warm up small sb space, expanding sb region by SB_REGION_EXPAND_SIZE
@@ -221,7 +267,7 @@ BaseMeta::BaseMeta() noexcept
     //we skip the first sb on purpose so that CrossPtr doesn't start from 0.
     tmp_sec_start = (char*)((uint64_t)tmp_sec_start+SBSIZE);
     organize_sb_list(tmp_sec_start, SB_REGION_EXPAND_SIZE/SBSIZE-1);
-    FLUSHFENCE;
+    pbuf_commit();
 }
 
 // inline void* BaseMeta::expand_sb(size_t sz){
@@ -307,9 +353,135 @@ uint32_t BaseMeta::compute_idx(char* superblock, char* block, size_t sc_idx) {
     return idx;
 }
 
+bool BaseMeta::claim_fresh_sb(char* sb, size_t size) {
+    uint64_t start = (uint64_t)_rgs->untranslate(SB_IDX, sb);
+    uint64_t end = start + size;
+    uint64_t mark = fresh_sb.load();
+    // sbs are handed out in ascending order from a new expansion, so only
+    // those at or above the mark can be fresh. A concurrent claim of a
+    // higher sb may move the mark past this one, which only loses a chance
+    // to skip zeroing.
+    bool fresh = mark != NO_FRESH_SB && start >= mark;
+    while (mark != NO_FRESH_SB && mark < end) {
+        if (fresh_sb.compare_exchange_weak(mark, end)) {
+            pbuf_add(&fresh_sb, sizeof(fresh_sb));
+            break;
+        }
+    }
+    return fresh;
+}
+
+void BaseMeta::clear_fresh_sb() {
+    fresh_sb.store(NO_FRESH_SB);
+    pbuf_add(&fresh_sb, sizeof(fresh_sb));
+    pbuf_commit();
+}
+
+void BaseMeta::ckpt_invalidate() {
+#ifdef SB_BITMAP
+    ckpt_valid = 0;
+    ckpt_leaky = false;
+    pbuf_add(&ckpt_valid, sizeof(ckpt_valid));
+    pbuf_add(&ckpt_leaky, sizeof(ckpt_leaky));
+    pbuf_commit();
+#endif
+}
+
+#ifdef SB_BITMAP
+inline void BaseMeta::tag_epoch(Descriptor* desc) {
+    // the change is visible to a checkpoint that bumps the epoch after this
+    // load, and any later one finds the new epoch
+    uint64_t epoch = ckpt_epoch.load();
+    uint64_t old = desc->epoch.load(memory_order_relaxed);
+    if (LIKELY(old >= epoch))
+        return;
+    while (old < epoch && !desc->epoch.compare_exchange_weak(old, epoch));
+    pbuf_add(&desc->epoch, sizeof(desc->epoch));
+    pbuf_commit();
+}
+
+uint64_t BaseMeta::checkpoint() {
+    std::lock_guard<std::mutex> lk(ckpt_mtx);
+    // bitmaps of sbs not swept yet are stale
+    GarbageCollection* gc = lazy_gc.load();
+    if (gc != nullptr && gc->is_lazy_pending())
+        return 0;
+    PbufSite site(PBUF_SITE_CHECKPOINT);
+    // sbs changed from now on are tagged with the new epoch, which must not
+    // write to the copy of the last checkpoint
+    uint64_t step = 1;
+    if (ckpt_valid != 0 && (ckpt_epoch.load() + 1) % 2 == ckpt_valid % 2)
+        step = 2;
+    uint64_t epoch = ckpt_epoch.fetch_add(step) + step;
+    pbuf_add(&ckpt_epoch, sizeof(ckpt_epoch));
+    pbuf_commit();
+
+    char* sb_base = _rgs->lookup(SB_IDX);
+    char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    for (char* sb = sb_base + SBSIZE; sb < sb_end; sb += SBSIZE) {
+        Descriptor* desc = desc_lookup(sb);
+        // unused sbs and large blocks are told by their descriptors
+        if (desc->heap == nullptr || desc->superblock != sb ||
+            desc->heap->sc_idx == 0)
+            continue;
+        if (desc->epoch.load() >= epoch)
+            continue;
+        uint32_t const maxcount = desc->maxcount;
+        uint32_t const word_num = (maxcount + 63) / 64;
+        Anchor anchor = desc->anchor.load();
+        std::atomic<uint64_t>* bitmap = bitmap_lookup(desc);
+        std::atomic<uint64_t>* saved = ckpt_lookup(desc, epoch);
+        uint64_t free_num = 0;
+        for (uint32_t w = 0; w < word_num; w++) {
+            uint64_t word = bitmap[w].load();
+            saved[w].store(word, memory_order_relaxed);
+            free_num += __builtin_popcountll(word);
+        }
+        // an empty anchor counts one block less
+        uint64_t count = anchor.state == SB_EMPTY ? maxcount : anchor.count;
+        if (free_num == count) {
+            pbuf_add(saved, word_num * sizeof(uint64_t));
+        } else {
+            // some free bits are reserved by a cache or not yet given back
+            // to the anchor, so the sb can't be trusted
+            uint64_t old = desc->epoch.load();
+            while (old < epoch && !desc->epoch.compare_exchange_weak(old, epoch));
+            pbuf_add(&desc->epoch, sizeof(desc->epoch));
+        }
+    }
+    pbuf_commit();
+    // publish after what it refers to is persistent
+    ckpt_valid = epoch;
+    pbuf_add(&ckpt_valid, sizeof(ckpt_valid));
+    pbuf_commit();
+    return epoch;
+}
+
+std::atomic<uint64_t>* BaseMeta::ckpt_lookup(const Descriptor* desc, uint64_t epoch){
+    uint64_t desc_index = (((uint64_t)desc)>>DESC_SHIFT) - (((uint64_t)_rgs->lookup(DESC_IDX))>>DESC_SHIFT);
+    // the region is led by a page of region metadata
+    uint64_t slot_num = (_rgs->regions[CKPT_IDX]->FILESIZE - PAGESIZE) / 2 / SB_BITMAP_SIZE;
+    char* ret = _rgs->lookup(CKPT_IDX) + ((epoch % 2) * slot_num + desc_index) * SB_BITMAP_SIZE;
+    return reinterpret_cast<std::atomic<uint64_t>*>(ret);
+}
+#endif
+
+inline void BaseMeta::mark_dirty(Descriptor* desc) {
+    _rgs->mark_dirty(DESC_IDX, desc, sizeof(Descriptor));
+#ifdef SB_BITMAP
+    _rgs->mark_dirty(BITMAP_IDX, bitmap_lookup(desc), SB_BITMAP_SIZE);
+#endif
+}
+
 void BaseMeta::fill_cache(size_t sc_idx, TCacheBin* cache) {
+    PbufSite site(PBUF_SITE_FILL_CACHE);
     // at most cache will be filled with number of blocks equal to superblock
     size_t block_num = 0;
+    // during lazy recovery, sweep sbs of this size class until one has
+    // free blocks
+    GarbageCollection* gc = lazy_gc.load(memory_order_relaxed);
+    if (UNLIKELY(gc != nullptr) && gc->is_lazy_pending())
+        gc->sweep_sc(sc_idx);
     // use a *SINGLE* partial superblock to try to fill cache
     malloc_from_partial(sc_idx, cache, block_num);
     // if we obtain no blocks from partial superblocks, create a new superblock
@@ -323,7 +495,7 @@ void BaseMeta::fill_cache(size_t sc_idx, TCacheBin* cache) {
 }
 
 void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache) {
-//    return;
+    PbufSite site(PBUF_SITE_FLUSH_CACHE);
     ProcHeap* heap = &heaps[sc_idx];
     SizeClassData* sc = get_sizeclass_by_idx(sc_idx);
     uint32_t const sb_size = sc->sb_size;
@@ -333,13 +505,61 @@ void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache) {
     uint32_t const maxcount = sc->get_block_num();
     (void)maxcount; // suppress unused warning
 
-    char* tmp_ptr=cache->_block;
-    if (tmp_ptr!=nullptr && cache->_superblock!= nullptr){
-        for (uint32_t idx = cache->_block_idx; idx < maxcount - 1; ++idx) {
-            pptr<char>* block = (pptr<char>*)(cache->_superblock + idx * block_size);
-            char* next = cache->_superblock + (idx + 1) * block_size;
-            *block = next;
+#ifdef SB_BITMAP
+    if (cache->_carve_num > 0) {
+        // reserved blocks are still marked free in the bitmap, so we only
+        // need to give them back to the anchor
+        uint32_t carve_num = cache->_carve_num;
+        Descriptor* desc = desc_lookup(cache->_superblock);
+        cache->_block_num -= carve_num;
+        cache->_carve_num = 0;
+        cache->_superblock = nullptr;
+        bitmap_release(desc, carve_num);
+    }
+
+    while (cache->get_block_num() > 0) {
+        char* tail = cache->peek_block();
+        char* next = nullptr;
+        Descriptor* desc = desc_lookup(tail);
+        char* superblock = static_cast<char*>(desc->superblock);
+        std::atomic<uint64_t>* bitmap = bitmap_lookup(desc);
+
+        // set free bits of consecutive cache blocks in the same superblock.
+        // the link must be read before the bit is set since the block can
+        // be claimed by others right after that.
+        uint32_t block_count = 0;
+        do {
+            next = static_cast<char*>(*(pptr<char>*)tail);
+            uint32_t idx = compute_idx(superblock, tail, sc_idx);
+            bitmap[idx / 64].fetch_or(1ULL << (idx % 64));
+            ++block_count;
+            tail = next;
+        } while (cache->get_block_num() > block_count &&
+            next >= superblock && next < superblock + sb_size);
+
+        cache->pop_list(next, block_count);
+        bitmap_release(desc, block_count);
+    }
+#else
+    if (cache->_carve_num > 0) {
+        // link blocks that haven't been carved in front of the list
+        char* superblock = cache->_superblock;
+        uint32_t const first = cache->_block_idx;
+        uint32_t const last = first + cache->_carve_num - 1;
+        for (uint32_t idx = first; idx < last; ++idx) {
+            pptr<char>* block = (pptr<char>*)(superblock + idx * block_size);
+            *block = superblock + (idx + 1) * block_size;
         }
+        pptr<char>* last_block = (pptr<char>*)(superblock + last * block_size);
+        _rgs->mark_dirty(SB_IDX, superblock + first * block_size,
+            (last - first + 1) * block_size);
+        if (cache->get_list_num() == 0)
+            *last_block = nullptr;
+        else
+            *last_block = cache->peek_block();
+        cache->_block = superblock + first * block_size;
+        cache->_carve_num = 0;
+        cache->_superblock = nullptr;
     }
 
     // @todo: optimize
@@ -350,6 +570,10 @@ void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache) {
         char* tail = head;
         Descriptor* desc = desc_lookup(head);
         char* superblock = static_cast<char*>(desc->superblock);
+        // span of the blocks returned to this sb, whose links were written
+        // when they were pushed to cache
+        char* low = head;
+        char* high = head;
 
         // cache is a linked list of blocks
         // superblock free list is also a linked list of blocks
@@ -366,9 +590,14 @@ void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache) {
             // ptr in superblock, add to "list"
             ++block_count;
             tail = ptr;
+            if (ptr < low) low = ptr;
+            else if (ptr > high) high = ptr;
         }
 
         cache->pop_list(static_cast<char*>(*(pptr<char>*)tail), block_count);
+        // once per sb rather than per block
+        mark_dirty(desc);
+        _rgs->mark_dirty(SB_IDX, low, high - low + sizeof(pptr<char>));
 
         // add list to desc, update anchor
         uint32_t idx = compute_idx(superblock, head, sc_idx);
@@ -415,8 +644,62 @@ void BaseMeta::flush_cache(size_t sc_idx, TCacheBin* cache) {
             }
         }
     }
+#endif
 }
 
+#ifdef SB_BITMAP
+void BaseMeta::bitmap_release(Descriptor* desc, uint32_t block_count) {
+    char* superblock = static_cast<char*>(desc->superblock);
+    uint32_t const maxcount = desc->maxcount;
+    mark_dirty(desc);
+    // bits are set, and we still hold the blocks so desc can't be reused
+    tag_epoch(desc);
+
+    Anchor oldanchor = desc->anchor.load();
+    Anchor newanchor;
+    do {
+        newanchor = oldanchor;
+        if (oldanchor.state == SB_FULL)
+            newanchor.state = SB_PARTIAL;
+        assert(oldanchor.count < maxcount);
+        if (oldanchor.count + block_count == maxcount) {
+            newanchor.count = maxcount - 1;
+            newanchor.state = SB_EMPTY; // can free superblock
+        }
+        else
+            newanchor.count += block_count;
+    }
+    while (!desc->anchor.compare_exchange_weak(oldanchor, newanchor));
+
+    // after last CAS, can't reliably read any desc fields
+    // as desc might have become empty and been concurrently reused
+    if (oldanchor.state == SB_FULL) {
+        if(newanchor.state == SB_EMPTY) {
+            // this sb becomes empty from full
+            small_sb_retire(superblock, SBSIZE);
+        } else {
+            // this sb becomes partial from full
+            heap_push_partial(desc);
+        }
+    }
+}
+
+std::atomic<uint64_t>* BaseMeta::bitmap_lookup(const Descriptor* desc){
+    uint64_t desc_index = (((uint64_t)desc)>>DESC_SHIFT) - (((uint64_t)_rgs->lookup(DESC_IDX))>>DESC_SHIFT);
+    char* ret = _rgs->lookup(BITMAP_IDX) + desc_index * SB_BITMAP_SIZE;
+    return reinterpret_cast<std::atomic<uint64_t>*>(ret);
+}
+
+uint32_t BaseMeta::bitmap_fill(std::atomic<uint64_t>* bitmap, uint32_t maxcount){
+    uint32_t const word_num = (maxcount + 63) / 64;
+    for (uint32_t i = 0; i < maxcount / 64; i++)
+        bitmap[i].store(~0ULL, memory_order_relaxed);
+    if (maxcount % 64 != 0)
+        bitmap[word_num - 1].store((1ULL << (maxcount % 64)) - 1, memory_order_relaxed);
+    return word_num;
+}
+#endif
+
 Descriptor* BaseMeta::desc_lookup(const char* ptr){
     uint64_t sb_index = (((uint64_t)ptr)>>SB_SHIFT) - (((uint64_t)_rgs->lookup(SB_IDX))>>SB_SHIFT); // the index of sb this block in
     Descriptor* ret = reinterpret_cast<Descriptor*>(_rgs->lookup(DESC_IDX));
@@ -433,6 +716,7 @@ char* BaseMeta::sb_lookup(Descriptor* desc){
 
 void BaseMeta::heap_push_partial(Descriptor* desc) {
     ProcHeap* heap = desc->heap;
+    mark_dirty(desc);
     ptr_cnt<Descriptor> oldhead = heap->partial_list.load();
     ptr_cnt<Descriptor> newhead;
     do {
@@ -495,6 +779,7 @@ retry:
     }
     while (!desc->anchor.compare_exchange_weak(
                 oldanchor, newanchor));
+    mark_dirty(desc);
 
     // will take as many blocks as available from superblock
     // *AND* no thread can do malloc() using this superblock, we
@@ -502,6 +787,13 @@ retry:
     // if CAS fails, it just means another thread added more available blocks
     //  through FlushCache, which we can then use
     uint32_t block_take = oldanchor.count;
+#ifdef SB_BITMAP
+    // blocks are reserved but their bits are claimed lazily by the cache
+    assert(cache->get_block_num() == 0);
+    tag_epoch(desc);
+    cache->push_bitmap(superblock, bitmap_lookup(desc), block_size, maxcount,
+        block_take);
+#else
     uint32_t avail = oldanchor.avail;
 
     assert(avail < maxcount);
@@ -512,6 +804,7 @@ retry:
     // so all we need do is "push" that list, a constant time op
     assert(cache->get_block_num() == 0);
     cache->push_list(block, block_take);
+#endif
 
     block_num += block_take;
 }
@@ -525,35 +818,40 @@ void BaseMeta::malloc_from_newsb(size_t sc_idx, TCacheBin* cache, size_t& block_
     char* superblock = reinterpret_cast<char*>(small_sb_alloc(sc->sb_size));
     assert(superblock);
     Descriptor* desc = desc_lookup(superblock);
+    // the mark is moved in both modes, but only the carving cache can tell
+    // whether a popped block comes straight from the untouched sb
+    bool fresh = claim_fresh_sb(superblock, SBSIZE);
+    (void)fresh;
 
     desc->heap = heap;
     desc->block_size = block_size;
     desc->maxcount = maxcount;
     desc->superblock = superblock;
 
-    // prepare block list
-//    for (uint32_t idx = 0; idx < maxcount - 1; ++idx) {
-//        pptr<char>* block = (pptr<char>*)(superblock + idx * block_size);
-//        char* next = superblock + (idx + 1) * block_size;
-//        *block = next;
-//    }
-
-    // push blocks to thread local cache
-    char* block = superblock; // first block
-    cache->push_list(block, maxcount);
-    cache->_block_size=block_size;
-    cache->_block_idx=0;
-    cache->_superblock=superblock;
-    cache->_maxcount=maxcount;
+    // push blocks to thread local cache, which are carved lazily instead of
+    // being organized as a list here
+#ifdef SB_BITMAP
+    std::atomic<uint64_t>* bitmap = bitmap_lookup(desc);
+    bitmap_fill(bitmap, maxcount);
+    // bits are claimed later by the cache
+    mark_dirty(desc);
+    cache->push_bitmap(superblock, bitmap, block_size, maxcount, maxcount);
+#else
+    cache->push_superblock(superblock, block_size, maxcount, fresh);
+#endif
 
     Anchor anchor;
     anchor.avail = maxcount;
     anchor.count = 0;
     anchor.state = SB_FULL;
     desc->anchor.store(anchor);
+#ifdef SB_BITMAP
+    // what the last checkpoint saved for this sb is stale
+    tag_epoch(desc);
+#endif
 
-    FLUSH(desc);
-    FLUSHFENCE;
+    pbuf_add(desc, sizeof(Descriptor));
+    pbuf_commit();
 
     assert(anchor.avail < maxcount || anchor.state == SB_FULL);
     assert(anchor.count < maxcount);
@@ -582,6 +880,7 @@ inline void BaseMeta::organize_sb_list(void* start, uint64_t count){
         desc->next_free.store(oldhead.get_ptr());
         newhead.set(desc_start, oldhead.get_counter()+1);
     }while(!avail_sb.compare_exchange_weak(oldhead,newhead));
+    pbuf_commit();
 }
 
 void* BaseMeta::small_sb_alloc(size_t size){
@@ -591,6 +890,7 @@ void* BaseMeta::small_sb_alloc(size_t size){
     }
 
     Descriptor* oldptr = nullptr;
+    bool swept_all = false;
 
     ptr_cnt<Descriptor> oldhead = avail_sb.load();
     while(true){
@@ -615,18 +915,27 @@ void* BaseMeta::small_sb_alloc(size_t size){
             next = new_curr_addr + SB_REGION_EXPAND_SIZE;
             if (avail_sb.load().get_ptr() != nullptr){
                 // ensure this expansion is necessary
+                oldhead = avail_sb.load();
                 continue;
             }
             if (next > _rgs->regions[SB_IDX]->base_addr + _rgs->regions[SB_IDX]->FILESIZE){
+                // during lazy recovery, free sbs may be waiting to be swept
+                GarbageCollection* gc = lazy_gc.load(memory_order_relaxed);
+                if (!swept_all && gc != nullptr && gc->is_lazy_pending()) {
+                    gc->sweep_remaining();
+                    swept_all = true;
+                    oldhead = avail_sb.load();
+                    continue;
+                }
                 printf("\n----Region Manager: out of space in mmaped file-----\nCurr:%p\nBase:%p\n",res,_rgs->regions[SB_IDX]->base_addr);
                 assert(0);
             }
             new_curr_addr = next;
-            FLUSH(_rgs->regions[SB_IDX]->curr_addr_ptr);
-            FLUSHFENCE;
+            pbuf_add(_rgs->regions[SB_IDX]->curr_addr_ptr, sizeof(atomic_pptr<char>));
+            pbuf_commit();
             if(_rgs->regions[SB_IDX]->curr_addr_ptr->compare_exchange_strong(old_curr_addr, new_curr_addr)){
-                FLUSH(_rgs->regions[SB_IDX]->curr_addr_ptr);
-                FLUSHFENCE;
+                pbuf_add(_rgs->regions[SB_IDX]->curr_addr_ptr, sizeof(atomic_pptr<char>));
+                pbuf_commit();
                 DBG_PRINT("expand sb space for small sb allocation\n");
                 organize_sb_list((char*)((uint64_t)res+SBSIZE), SB_REGION_EXPAND_SIZE/SBSIZE-1);
                 Descriptor* desc = desc_lookup(res);
@@ -641,6 +950,11 @@ inline void BaseMeta::small_sb_retire(void* sb, size_t size){
     assert(size == SBSIZE);
     Descriptor* desc = desc_lookup(sb);
     new (desc) Descriptor(); // at this time we erase data in this desc
+    pbuf_commit();
+    push_avail_sb(desc);
+}
+
+void BaseMeta::push_avail_sb(Descriptor* desc){
     ptr_cnt<Descriptor> oldhead = avail_sb.load();
     ptr_cnt<Descriptor> newhead;
     do{
@@ -670,30 +984,37 @@ inline void* BaseMeta::alloc_large_block(size_t sz){
     return large_sb_alloc(sz);
 }
 
-void* BaseMeta::do_malloc(size_t size){
-    if (UNLIKELY(size > MAX_SZ)) {
-        // large block allocation
-        size_t sbs = round_up(size, SBSIZE);//round size up to multiple of SBSIZE
-        char* ptr = (char*)alloc_large_block(sbs);
-        assert(ptr);
-        Descriptor* desc = desc_lookup(ptr);
+void* BaseMeta::malloc_large(size_t size, bool& fresh){
+    PbufSite site(PBUF_SITE_MALLOC);
+    size_t sbs = round_up(size, SBSIZE);//round size up to multiple of SBSIZE
+    char* ptr = (char*)alloc_large_block(sbs);
+    assert(ptr);
+    Descriptor* desc = desc_lookup(ptr);
+    fresh = claim_fresh_sb(ptr, sbs);
 
-        desc->heap = &heaps[0];
-        desc->block_size = sbs;
-        desc->maxcount = 1;
-        desc->superblock = ptr;
+    desc->heap = &heaps[0];
+    desc->block_size = sbs;
+    desc->maxcount = 1;
+    desc->superblock = ptr;
 
-        Anchor anchor;
-        anchor.avail = 0;
-        anchor.count = 0;
-        anchor.state = SB_FULL;
-        desc->anchor.store(anchor);
+    Anchor anchor;
+    anchor.avail = 0;
+    anchor.count = 0;
+    anchor.state = SB_FULL;
+    desc->anchor.store(anchor);
 
-        FLUSH(&desc);
-        FLUSHFENCE;
+    pbuf_add(desc, sizeof(Descriptor));
+    pbuf_commit();
 
-        DBG_PRINT("large, ptr: %p", ptr);
-        return (void*)ptr;
+    DBG_PRINT("large, ptr: %p", ptr);
+    return (void*)ptr;
+}
+
+void* BaseMeta::do_malloc(size_t size){
+    if (UNLIKELY(size > MAX_SZ)) {
+        // large block allocation
+        bool fresh;
+        return malloc_large(size, fresh);
     }
 
     // size class calculation
@@ -707,6 +1028,20 @@ void* BaseMeta::do_malloc(size_t size){
     return cache->pop_block();
 }
 
+void* BaseMeta::do_malloc(size_t size, bool& fresh){
+    if (UNLIKELY(size > MAX_SZ)) {
+        return malloc_large(size, fresh);
+    }
+
+    size_t sc_idx = get_sizeclass(size);
+
+    TCacheBin* cache = &t_caches.t_cache[sc_idx];
+    if (UNLIKELY(cache->get_block_num() == 0))
+        fill_cache(sc_idx, cache);
+
+    return cache->pop_block(fresh);
+}
+
 
 #include <x86intrin.h>
 
@@ -727,6 +1062,10 @@ void BaseMeta::do_free(void* ptr){
 
     if(ptr==nullptr) return;
     assert(_rgs->in_range(SB_IDX,ptr));
+    // the sb must be rebuilt before its metadata is updated
+    GarbageCollection* gc = lazy_gc.load(memory_order_relaxed);
+    if (UNLIKELY(gc != nullptr) && gc->is_lazy_pending())
+        gc->sweep_for(ptr);
     Descriptor* desc = desc_lookup(ptr);
     // @todo: this can happen with dynamic loading
     // need to print correct message
@@ -736,6 +1075,7 @@ void BaseMeta::do_free(void* ptr){
 
     // large allocation case
     if (UNLIKELY(!sc_idx)) {
+        PbufSite site(PBUF_SITE_FREE);
         char* superblock = desc->superblock;
         // free superblock
         large_sb_retire(superblock, desc->block_size);
@@ -773,180 +1113,1139 @@ void ralloc::public_flush_cache(){
     }
 }
 
-/*
- * function GarbageCollection::operator()
- * 
- * Description:
- *  Sequential stop-the-world garbage collection routine for Ralloc when dirty
- *  segment exists.
- */
-void GarbageCollection::operator() () {
-    printf("Start garbage collection...\n");
-//    auto start = high_resolution_clock::now();
+// check output, printed at verbose level 1 or higher
+#define CHECK_FAIL(...) do { errors++; GC_LOG(1, __VA_ARGS__); } while(0)
+// number of blocks handed to a checking thread at a time
+static const uint64_t CHECK_CHUNK = 64;
+
+uint64_t BaseMeta::check(RP_check_report* report, int thread_num){
+    if(thread_num <= 0) thread_num = omp_get_max_threads();
+    memset(report, 0, sizeof(RP_check_report));
+    bool const dirty = is_dirty();
+    report->dirty = dirty;
+    char* sb_base = _rgs->lookup(SB_IDX);
+    char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    uint64_t const sb_num = ((uint64_t)(sb_end - sb_base) + SBSIZE - 1) >> SB_SHIFT;
+    Descriptor* const desc_base = desc_lookup(sb_base);
+    for(int sc = 1; sc < MAX_SZ_IDX; sc++)
+        report->sc[sc].block_size = get_sizeclass_by_idx(sc)->block_size;
+    // sb 0 is never handed out
+    report->sb_num = sb_num - 1;
+    uint64_t errors = 0;
+
+    // list each sb is on: size class of its partial list, or AVAIL
+    const uint8_t AVAIL = MAX_SZ_IDX;
+    std::vector<uint8_t> listed(sb_num, 0);
+    auto walk = [&](Descriptor* desc, uint8_t list, bool partial){
+        for(uint64_t n = 0; desc != nullptr; n++) {
+            uint64_t i = desc - desc_base;
+            if(desc < desc_base + 1 || i >= sb_num) {
+                CHECK_FAIL("list %u: descriptor %p out of range\n", list, desc);
+                return;
+            }
+            if(listed[i] != 0) {
+                CHECK_FAIL("list %u: sb %lu already on list %u\n", list, i, listed[i]);
+                return;
+            }
+            listed[i] = list;
+            desc = partial ? desc->next_partial.load() : desc->next_free.load();
+        }
+    };
+    if(!dirty) {
+        for(int sc = 1; sc < MAX_SZ_IDX; sc++)
+            walk(heaps[sc].partial_list.load().get_ptr(), sc, true);
+        walk(avail_sb.load().get_ptr(), AVAIL, false);
+    }
+
+    // first sb of each block, as GarbageCollection::from_checkpoint finds
+    std::vector<uint64_t> firsts;
+    uint64_t i = 1;
+    while(i < sb_num) {
+        char* sb = sb_base + (i << SB_SHIFT);
+        Descriptor* desc = desc_lookup(sb);
+        ProcHeap* heap = desc->heap;
+        if(heap == nullptr || desc->superblock != sb) {
+            report->sb_free++;
+            if(!dirty && listed[i] != AVAIL)
+                CHECK_FAIL("sb %lu: free but not on the free sb list\n", i);
+            i++;
+            continue;
+        }
+        firsts.push_back(i);
+        if(heap != &heaps[0]) {
+            i++;
+            continue;
+        }
+        uint64_t span = ((uint64_t)desc->block_size + SBSIZE - 1) >> SB_SHIFT;
+        if(span == 0 || span > sb_num - i) {
+            CHECK_FAIL("sb %lu: large block of %u bytes out of the region\n", i, desc->block_size);
+            span = 1;
+        }
+        for(uint64_t j = i + 1; j < i + span; j++) {
+            if(listed[j] != 0)
+                CHECK_FAIL("sb %lu: in large block at sb %lu but on list %u\n", j, i, listed[j]);
+        }
+        report->sc[0].sb_num += span;
+        i += span;
+    }
+
+    RP_sc_usage* usages = new RP_sc_usage[thread_num * MAX_SZ_IDX]();
+#pragma omp parallel num_threads(thread_num) reduction(+:errors)
+    {
+        RP_sc_usage* usage = usages + omp_get_thread_num() * MAX_SZ_IDX;
+        // free blocks seen in the current sb
+        std::vector<uint64_t> seen;
+#pragma omp for schedule(dynamic, CHECK_CHUNK)
+        for(uint64_t k = 0; k < firsts.size(); k++) {
+            uint64_t const i = firsts[k];
+            char* superblock = sb_base + (i << SB_SHIFT);
+            Descriptor* desc = desc_lookup(superblock);
+            ProcHeap* heap = desc->heap;
+            uint64_t const sc = heap - heaps;
+            uint32_t const block_size = desc->block_size;
+            uint32_t const maxcount = desc->maxcount;
+            if(sc >= (uint64_t)MAX_SZ_IDX || heap != &heaps[sc]) {
+                CHECK_FAIL("sb %lu: heap %p isn't a size class\n", i, heap);
+                continue;
+            }
+            if(sc == 0) {
+                usage[0].block_num++;
+                if(block_size % SBSIZE != 0 || maxcount != 1)
+                    CHECK_FAIL("sb %lu: large block of %u bytes with %u blocks\n", i, block_size, maxcount);
+                if(!dirty && desc->anchor.load().state != SB_FULL)
+                    CHECK_FAIL("sb %lu: large block not full\n", i);
+                continue;
+            }
+            SizeClassData* sc_data = get_sizeclass_by_idx(sc);
+            if(block_size != sc_data->block_size || maxcount != sc_data->get_block_num()) {
+                CHECK_FAIL("sb %lu: %u blocks of %u bytes in size class %lu\n", i, maxcount, block_size, sc);
+                continue;
+            }
+            usage[sc].sb_num++;
+            usage[sc].block_num += maxcount;
+            if(dirty) continue;
+
+            Anchor anchor = desc->anchor.load();
+            uint64_t free_num;
+            switch(anchor.state) {
+            case SB_FULL:
+                free_num = 0;
+                break;
+            case SB_PARTIAL:
+                free_num = anchor.count;
+                if(anchor.count == 0 || anchor.count >= maxcount)
+                    CHECK_FAIL("sb %lu: partial with %u of %u blocks free\n", i, (uint32_t)anchor.count, maxcount);
+                break;
+            case SB_EMPTY:
+                // left on its partial list until taken
+                free_num = maxcount;
+                break;
+            default:
+                CHECK_FAIL("sb %lu: invalid anchor state %u\n", i, (uint32_t)anchor.state);
+                continue;
+            }
+            if((anchor.state != SB_FULL) != (listed[i] == sc))
+                CHECK_FAIL("sb %lu: state %u but on list %u\n", i, (uint32_t)anchor.state, listed[i]);
+            usage[sc].free_num += free_num;
+#ifdef SB_BITMAP
+            std::atomic<uint64_t>* bitmap = bitmap_lookup(desc);
+            uint64_t bit_num = 0;
+            for(uint32_t w = 0; w < (maxcount + 63) / 64; w++) {
+                uint64_t word = bitmap[w].load(memory_order_relaxed);
+                if(maxcount - w * 64 < 64 && (word >> (maxcount - w * 64)) != 0)
+                    CHECK_FAIL("sb %lu: free bits beyond %u blocks\n", i, maxcount);
+                bit_num += __builtin_popcountll(word);
+            }
+            if(bit_num != free_num)
+                CHECK_FAIL("sb %lu: %lu free bits but %lu free blocks\n", i, bit_num, free_num);
+#else
+            // free blocks are linked through their first word from avail
+            seen.assign((maxcount + 63) / 64, 0);
+            char* const sb_limit = superblock + (uint64_t)maxcount * block_size;
+            uint64_t idx = anchor.avail;
+            for(uint64_t n = 0; n < free_num; n++) {
+                if(idx >= maxcount || (seen[idx / 64] & (1ULL << (idx % 64)))) {
+                    CHECK_FAIL("sb %lu: free list broken after %lu of %lu blocks\n", i, n, free_num);
+                    break;
+                }
+                seen[idx / 64] |= 1ULL << (idx % 64);
+                if(n + 1 == free_num) break;
+                char* next = static_cast<char*>(*reinterpret_cast<pptr<char>*>(superblock + idx * block_size));
+                if(next < superblock || next >= sb_limit || (uint64_t)(next - superblock) % block_size != 0) {
+                    CHECK_FAIL("sb %lu: free list leaves the sb after %lu of %lu blocks\n", i, n + 1, free_num);
+                    break;
+                }
+                idx = (uint64_t)(next - superblock) / block_size;
+            }
+#endif
+        }
+    }
+    for(int t = 0; t < thread_num; t++) {
+        for(int sc = 0; sc < MAX_SZ_IDX; sc++) {
+            report->sc[sc].sb_num += usages[t * MAX_SZ_IDX + sc].sb_num;
+            report->sc[sc].block_num += usages[t * MAX_SZ_IDX + sc].block_num;
+            report->sc[sc].free_num += usages[t * MAX_SZ_IDX + sc].free_num;
+        }
+    }
+    delete[] usages;
+    report->errors = errors;
+    return errors;
+}
+
+GarbageCollection::~GarbageCollection(){
+    finish_lazy();
+    delete[] sweep_state;
+    delete[] sb_marks;
+    delete[] mark_bits;
+    delete[] pin_bits;
+    delete[] ref_bits;
+    delete[] deques;
+}
+
+void GarbageCollection::init_marks(){
+    if(thread_num <= 0) thread_num = omp_get_max_threads();
+    deques = new MarkDeque[thread_num];
+    sb_base = _rgs->lookup(SB_IDX);
+    char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    sb_num = ((uint64_t)(sb_end - sb_base) + SBSIZE - 1) >> SB_SHIFT;
+    sb_marks = new SbMarks[sb_num]();
+    // give each sb in use maxcount bits, and all sbs of a large block the
+    // same single bit. sb 0 is never handed out.
+    uint64_t bit_num = 0;
+    uint64_t i = 1;
+    while(i < sb_num) {
+        char* sb = sb_base + (i << SB_SHIFT);
+        Descriptor* desc = base_md->desc_lookup(sb);
+        if(desc->heap == nullptr || desc->superblock != sb) {
+            i++;
+            continue;
+        }
+        SbMarks m;
+        m.start = sb;
+        m.bit = bit_num;
+        m.block_size = desc->block_size;
+        m.sc_idx = desc->heap->sc_idx;
+        uint64_t span = 1;
+        if(m.sc_idx == 0) {
+            m.maxcount = 1;
+            span = (m.block_size + SBSIZE - 1) >> SB_SHIFT;
+        } else {
+            m.maxcount = desc->maxcount;
+        }
+        bit_num += m.maxcount;
+        for(uint64_t j = 0; j < span && i < sb_num; j++, i++) {
+            sb_marks[i] = m;
+        }
+    }
+    uint64_t word_num = (bit_num + 63) / 64 + 1;
+    mark_bits = new std::atomic<uint64_t>[word_num]();
+    mark_bytes = word_num * sizeof(uint64_t) + sb_num * sizeof(SbMarks);
+    if(compacting) {
+        pin_bits = new std::atomic<uint64_t>[word_num]();
+        ref_bits = new std::atomic<uint64_t>[word_num]();
+        mark_bytes += 2 * word_num * sizeof(uint64_t);
+    }
+}
+
+inline char* GarbageCollection::find_block(char* ptr, uint64_t& bit){
+    if(UNLIKELY(!_rgs->in_range(SB_IDX, ptr))) return nullptr;
+    if(UNLIKELY(sb_marks == nullptr)) init_marks();
+    uint64_t sb_idx = ((uint64_t)ptr >> SB_SHIFT) - ((uint64_t)sb_base >> SB_SHIFT);
+    if(UNLIKELY(sb_idx >= sb_num)) return nullptr;
+    const SbMarks& m = sb_marks[sb_idx];
+    if(m.start == nullptr) return nullptr; // unused sb
+    uint64_t idx = 0;
+    if(m.sc_idx != 0) {
+        idx = base_md->compute_idx(m.start, ptr, m.sc_idx);
+        if(idx >= m.maxcount) return nullptr; // in the tail of sb
+    }
+    bit = m.bit + idx;
+    return m.start + idx * m.block_size;
+}
+
+// set bit in bits and return whether it was set already
+static inline bool test_and_set_bit(std::atomic<uint64_t>* bits, uint64_t bit){
+    uint64_t mask = 1ULL << (bit % 64);
+    std::atomic<uint64_t>& word = bits[bit / 64];
+    if(word.load(memory_order_relaxed) & mask) return true;
+    return word.fetch_or(mask, memory_order_relaxed) & mask;
+}
+
+char* GarbageCollection::mark_block(char* ptr){
+    // Step 1: check if it's a valid pptr
+    uint64_t bit;
+    char* blk = find_block(ptr, bit);
+    if(blk == nullptr) return nullptr;
+    // Step 2: mark the block unless someone else did
+    if(test_and_set_bit(mark_bits, bit)) return nullptr;
+    MarkDeque& dq = deques[omp_get_thread_num()];
+    dq.marked_num++;
+    dq.marked_bytes += sb_marks[(blk - sb_base) >> SB_SHIFT].block_size;
+    return blk;
+}
+
+void GarbageCollection::insert_block(char* ptr){
+    // the first inserters would otherwise all lay out mark bits
+    std::call_once(marks_once, [this]{ if(sb_marks == nullptr) init_marks(); });
+    uint64_t bit;
+    char* blk = find_block(ptr, bit);
+    if(blk == nullptr) return;
+    if(test_and_set_bit(mark_bits, bit)) return;
+    inserted_num.fetch_add(1, memory_order_relaxed);
+    inserted_bytes.fetch_add(sb_marks[(blk - sb_base) >> SB_SHIFT].block_size,
+        memory_order_relaxed);
+}
+
+void GarbageCollection::pin(char* ptr){
+    uint64_t bit;
+    if(find_block(ptr, bit) != nullptr) test_and_set_bit(pin_bits, bit);
+}
+
+void GarbageCollection::pin_ref(char* ptr){
+    pin(ptr);
+    pin(deques[omp_get_thread_num()].tracing);
+}
+
+void GarbageCollection::mark_ref(char* ptr, uint32_t type, void* field, uint32_t kind){
+    if(ptr == nullptr) return;
+    // fields are rewritten even if ptr isn't in a block, e.g., if it's
+    // tagged null, since a pptr moved with its block must be
+    deques[omp_get_thread_num()].refs.push_back({field, ptr, kind});
+    uint64_t bit;
+    if(find_block(ptr, bit) == nullptr) return;
+    // a block must have one field to it, or a crash while fields are
+    // rewritten could leave some pointing to its copy and others to itself
+    if(test_and_set_bit(ref_bits, bit)) test_and_set_bit(pin_bits, bit);
+    char* blk = mark_block(ptr);
+    if(blk != nullptr) push(blk, type);
+}
+
+void GarbageCollection::push(char* blk, uint32_t type){
+    MarkDeque& dq = deques[omp_get_thread_num()];
+    pending.fetch_add(1, memory_order_relaxed);
+    if(dq.fifo_num < prefetch_depth) {
+        dq.fifo_push({blk, type});
+        return;
+    }
+    dq.lock();
+    dq.items.push_back({blk, type});
+    dq.item_num.store(dq.items.size(), memory_order_relaxed);
+    dq.unlock();
+}
+
+bool GarbageCollection::pop(int tid, MarkItem& item){
+    MarkDeque& dq = deques[tid];
+    dq.lock();
+    bool ret = !dq.items.empty();
+    if(ret) {
+        item = dq.items.back();
+        dq.items.pop_back();
+        dq.item_num.store(dq.items.size(), memory_order_relaxed);
+    }
+    dq.unlock();
+    return ret;
+}
+
+bool GarbageCollection::steal(int tid, MarkItem& item){
+    for(int i = 1; i < thread_num; i++) {
+        MarkDeque& dq = deques[(tid + i) % thread_num];
+        if(dq.item_num.load(memory_order_relaxed) == 0) continue;
+        dq.lock();
+        bool ret = !dq.items.empty();
+        if(ret) {
+            item = dq.items.front();
+            dq.items.pop_front();
+            dq.item_num.store(dq.items.size(), memory_order_relaxed);
+        }
+        dq.unlock();
+        if(ret) return true;
+    }
+    return false;
+}
+
+bool GarbageCollection::next_item(int tid, MarkItem& item){
+    MarkDeque& dq = deques[tid];
+    MarkItem top;
+    // only the owner adds to its deque, so item_num of 0 is never stale
+    while(dq.fifo_num < prefetch_depth &&
+        dq.item_num.load(memory_order_relaxed) != 0 && pop(tid, top)) {
+        dq.fifo_push(top);
+    }
+    if(dq.fifo_num != 0) {
+        item = dq.fifo_pop();
+        return true;
+    }
+    return pop(tid, item) || steal(tid, item);
+}
+
+// decode word at addr if it's a non-null pptr and mark its target
+static inline void scan_candidate(GarbageCollection& gc, char* addr, uint64_t off){
+    if(is_null_pptr(off)) return;
+    char* target = off & 1 ? addr - (off >> PPTR_PATTERN_SHIFT) :
+        addr + (off >> PPTR_PATTERN_SHIFT);
+    gc.mark_typed(target, 0);
+}
+
+static void scan_scalar(GarbageCollection& gc, uint64_t* word, uint64_t* end){
+    for(; word < end; word++) {
+        uint64_t off = *word;
+        if((off & PPTR_PATTERN_MASK) == PPTR_PATTERN_POS)
+            scan_candidate(gc, reinterpret_cast<char*>(word), off);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(GarbageCollection& gc, uint64_t* word, uint64_t* end){
+    const __m256i mask = _mm256_set1_epi64x(PPTR_PATTERN_MASK);
+    const __m256i pattern = _mm256_set1_epi64x(PPTR_PATTERN_POS);
+    for(; word + 4 <= end; word += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i*>(word));
+        __m256i hit = _mm256_cmpeq_epi64(_mm256_and_si256(v, mask), pattern);
+        int bits = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+        while(bits != 0) {
+            int i = __builtin_ctz(bits);
+            scan_candidate(gc, reinterpret_cast<char*>(word + i), word[i]);
+            bits &= bits - 1;
+        }
+    }
+    scan_scalar(gc, word, end);
+}
+
+__attribute__((target("avx512f")))
+static void scan_avx512(GarbageCollection& gc, uint64_t* word, uint64_t* end){
+    const __m512i mask = _mm512_set1_epi64(PPTR_PATTERN_MASK);
+    const __m512i pattern = _mm512_set1_epi64(PPTR_PATTERN_POS);
+    for(; word + 8 <= end; word += 8) {
+        __m512i v = _mm512_loadu_si512(word);
+        unsigned bits = _mm512_cmpeq_epi64_mask(_mm512_and_si512(v, mask), pattern);
+        while(bits != 0) {
+            int i = __builtin_ctz(bits);
+            scan_candidate(gc, reinterpret_cast<char*>(word + i), word[i]);
+            bits &= bits - 1;
+        }
+    }
+    scan_scalar(gc, word, end);
+}
+
+typedef void (*ScanKernel)(GarbageCollection&, uint64_t*, uint64_t*);
+
+static ScanKernel pick_scan_kernel(){
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return scan_avx512;
+    if(__builtin_cpu_supports("avx2")) return scan_avx2;
+    return scan_scalar;
+}
+
+void GarbageCollection::scan_conservative(char* blk, size_t size){
+    static const ScanKernel kernel = pick_scan_kernel();
+    // blocks are 8-byte aligned, and so are pptrs in them unless packed
+    uint64_t* word = reinterpret_cast<uint64_t*>(blk);
+    kernel(*this, word, word + size / sizeof(uint64_t));
+}
+
+void GarbageCollection::mark_parallel(){
+#pragma omp parallel num_threads(thread_num)
+    {
+        int tid = omp_get_thread_num();
+        MarkItem item;
+        while(true) {
+            if(next_item(tid, item)) {
+                if(UNLIKELY(compacting)) {
+                    // pptrs in a block traced conservatively aren't known
+                    if(item.type == 0) pin(item.ptr);
+                    deques[tid].tracing = item.ptr;
+                }
+                tracers[item.type](item.ptr, *this);
+                // children were pushed before this, so pending stays
+                // above 0 while any of them is outstanding
+                pending.fetch_sub(1, memory_order_release);
+            } else if(pending.load(memory_order_acquire) == 0) {
+                break;
+            } else {
+                sched_yield();
+            }
+        }
+    }
+}
+
+Descriptor* GarbageCollection::sweep_sb(uint64_t i, int& state,
+    SweepCounts& counts){
+    char* curr_sb = sb_base + (i << SB_SHIFT);
+    Descriptor* curr_desc = base_md->desc_lookup(curr_sb);
+    const SbMarks& m = sb_marks[i];
+    Anchor anchor(0, 0, SB_EMPTY);
+
+    // a block is in use iff its mark bit is set; false positives were
+    // dropped by mark_block()
+    bool in_use = m.start != nullptr && any_marked(m.bit, m.maxcount);
+    if(in_use && m.start != curr_sb) {
+        // inside a large block in use, which is done with its first sb,
+        // whichever thread gets that
+        counts.state_num[SB_FULL]++;
+        return nullptr;
+    }
+    if(!in_use) {
+        // curr_sb isn't in use
+        new (curr_desc) Descriptor();
+        state = SB_EMPTY;
+        counts.state_num[SB_EMPTY]++;
+        if(m.start != nullptr) counts.reclaimed += SBSIZE;
+        return curr_desc;
+    }
+    if(m.sc_idx == 0) {
+        // large sb that's in use
+        assert(curr_desc->maxcount == 1);
+        anchor.avail = 0;
+        anchor.count = 0;
+        anchor.state = SB_FULL;
+
+        // set transient variables in curr_desc
+        curr_desc->next_free.store(nullptr);
+        curr_desc->next_partial.store(nullptr);
+        curr_desc->anchor.store(anchor);
+        pbuf_add(curr_desc, sizeof(Descriptor));
+        state = SB_FULL;
+        counts.state_num[SB_FULL]++;
+        return curr_desc;
+    }
+
+    // small sb that's in use
+#ifdef SB_BITMAP
+    // free bits are the complement of mark bits
+    std::atomic<uint64_t>* bitmap = base_md->bitmap_lookup(curr_desc);
+    uint32_t word_num = base_md->bitmap_fill(bitmap, m.maxcount);
+    for(uint32_t w = 0; w < word_num; w++) {
+        uint64_t word = bitmap[w].load(memory_order_relaxed) & ~marks_at(m.bit + w * 64);
+        bitmap[w].store(word, memory_order_relaxed);
+        anchor.count += __builtin_popcountll(word);
+    }
+    pbuf_add(bitmap, SB_BITMAP_SIZE);
+    anchor.avail = 0; // unused in bitmap format
+#else
+    char* free_blocks_head = nullptr;
+    for(uint32_t b = 0; b < m.maxcount; b++) {
+        if(is_marked(m.bit + b)) continue;
+        // put unmarked blocks to free blk list
+        char* free_block = curr_sb + b * m.block_size;
+        (*reinterpret_cast<pptr<char>*>(free_block)) = free_blocks_head;
+        free_blocks_head = free_block;
+        anchor.count++;
+    }
+    // free list is rebuilt through the whole sb
+    pbuf_add(curr_sb, m.maxcount * m.block_size);
+    if(anchor.count != 0)
+        anchor.avail = (uint64_t)(free_blocks_head - curr_sb)/m.block_size;
+#endif
+    curr_desc->next_free.store(nullptr);
+    curr_desc->next_partial.store(nullptr);
+    if(anchor.count == 0) { 
+        // this sb is fully used
+        anchor.avail = m.maxcount;
+        anchor.state = SB_FULL;
+    } else {
+        // this sb is partially used; caller links it to the heap
+        anchor.state = SB_PARTIAL;
+    }
+    curr_desc->anchor.store(anchor);
+    pbuf_add(curr_desc, sizeof(Descriptor));
+    state = anchor.state;
+    counts.state_num[state]++;
+    counts.reclaimed += anchor.count * m.block_size;
+    return curr_desc;
+}
+
+void GarbageCollection::SweepChains::link(Descriptor* desc, int state){
+    if(state == SB_EMPTY) {
+        desc->next_free.store(avail_head);
+        avail_head = desc;
+        if(avail_tail == nullptr) avail_tail = desc;
+    } else if(state == SB_PARTIAL) {
+        size_t sc_idx = desc->heap->sc_idx;
+        desc->next_partial.store(partial_head[sc_idx]);
+        partial_head[sc_idx] = desc;
+        if(partial_tail[sc_idx] == nullptr) partial_tail[sc_idx] = desc;
+    }
+}
+
+bool GarbageCollection::lazy_sweep_sb(uint64_t i){
+    uint8_t s = sweep_state[i].load(memory_order_acquire);
+    if(s == SWEPT) return false;
+    if(s == UNSWEPT && sweep_state[i].compare_exchange_strong(s, SWEEPING)) {
+        PbufSite site(PBUF_SITE_RECOVERY);
+        int state = SB_FULL;
+        SweepCounts counts = {};
+        Descriptor* desc = sweep_sb(i, state, counts);
+        pbuf_commit();
+        {
+            std::lock_guard<std::mutex> lk(lazy_mtx);
+            lazy_counts.add(counts);
+        }
+        // publish to lists the mutator allocates from
+        if(desc != nullptr && state == SB_EMPTY) {
+            base_md->push_avail_sb(desc);
+        } else if(desc != nullptr && state == SB_PARTIAL) {
+            base_md->heap_push_partial(desc);
+        }
+        sweep_state[i].store(SWEPT, memory_order_release);
+        return desc != nullptr && state == SB_PARTIAL;
+    }
+    // someone else is sweeping it
+    while(sweep_state[i].load(memory_order_acquire) != SWEPT) sched_yield();
+    return false;
+}
+
+void GarbageCollection::sweep_for(const void* ptr){
+    uint64_t i = ((uint64_t)ptr >> SB_SHIFT) - ((uint64_t)sb_base >> SB_SHIFT);
+    if(i >= sb_num) return; // handed out after restart
+    if(sweep_state[i].load(memory_order_acquire) == SWEPT) return;
+    // a large block is swept with its first sb
+    char* start = sb_marks[i].start;
+    if(start != nullptr)
+        i = ((uint64_t)start >> SB_SHIFT) - ((uint64_t)sb_base >> SB_SHIFT);
+    lazy_sweep_sb(i);
+}
+
+void GarbageCollection::sweep_sc(size_t sc_idx){
+    std::vector<uint64_t>& sbs = sc_sbs[sc_idx];
+    while(sc_next[sc_idx].load(memory_order_relaxed) < sbs.size()) {
+        uint64_t k = sc_next[sc_idx].fetch_add(1, memory_order_relaxed);
+        if(k >= sbs.size()) return;
+        if(lazy_sweep_sb(sbs[k])) return;
+    }
+}
+
+void GarbageCollection::sweep_remaining(){
+    for(uint64_t i = 1; i < sb_num; i++) {
+        lazy_sweep_sb(i);
+    }
+}
+
+void GarbageCollection::lazy_sweeper(){
+    auto start = high_resolution_clock::now();
+    sweep_remaining();
+    pbuf_add(base_md, sizeof(BaseMeta));
+    pbuf_commit();
+    pbuf_accumulate();
+    // marks stay until the destructor: sweep_for may still read sb_marks of an
+    // sb it saw unswept
+    uint64_t sweep_us = us_since(start);
+    {
+        // stats may be read meanwhile by get_stats
+        std::lock_guard<std::mutex> lk(lazy_mtx);
+        recovery_stats.sweep_us = sweep_us;
+        record_sweep(lazy_counts);
+    }
+    lazy_pending.store(false, memory_order_release);
+    GC_LOG(1, "Lazy sweep completed in %lu ms.\n", sweep_us / 1000);
+}
+
+void GarbageCollection::get_stats(RP_recovery_stats* stats){
+    std::lock_guard<std::mutex> lk(lazy_mtx);
+    *stats = recovery_stats;
+}
+
+void GarbageCollection::start_lazy(){
+    GC_LOG(2, "Start lazy garbage collection...\n");
+    auto start = high_resolution_clock::now();
+    init_transient();
+    mark_all();
+    recovery_stats.kind = RP_RECOVERY_LAZY;
+    recovery_stats.mark_us = us_since(start);
+    record_marks();
+    // sbs in use of each size class, to be swept first when it needs blocks
+    sweep_state = new std::atomic<uint8_t>[sb_num]();
+    for(uint64_t i = 1; i < sb_num; i++) {
+        const SbMarks& m = sb_marks[i];
+        if(m.start == sb_base + (i << SB_SHIFT) && m.sc_idx != 0 &&
+            any_marked(m.bit, m.maxcount))
+            sc_sbs[m.sc_idx].push_back(i);
+    }
+    // the last stats written before the sweeper may write any
+    recovery_stats.total_us = us_since(start);
+    lazy_pending.store(true, memory_order_release);
+    ralloc::lazy_gc.store(this, memory_order_release);
+    sweeper = std::thread(&GarbageCollection::lazy_sweeper, this);
+    GC_LOG(2, "Marked; sweeping in background.\n");
+}
+
+void GarbageCollection::finish_lazy(){
+    if(sweeper.joinable()) sweeper.join();
+}
+
+void GarbageCollection::init_transient(){
     // Step 0: initialize all transient data
-    printf("Initializing all transient data...");
+    GC_LOG(2, "Initializing all transient data...");
     base_md->avail_sb.off.store(nullptr); // initialize avail_sb
     for(int i = 0; i< MAX_SZ_IDX; i++) {
         // initialize partial list of each heap
         base_md->heaps[i].partial_list.off.store(nullptr);
     }
-    printf("Initialized!\n");
+    GC_LOG(2, "Initialized!\n");
+}
 
+void GarbageCollection::mark_all(){
     // Step 1: mark all accessible blocks from roots
-    printf("Marking reachable nodes...");
+    if(sb_marks == nullptr) init_marks();
+    GC_LOG(2, "Marking reachable nodes with %d threads...", thread_num);
 
     // First mark all root nodes
     for(int i = 0; i < MAX_ROOTS; i++) {
-        if(base_md->roots[i]!=nullptr) {
-            ralloc::roots_filter_func[i](base_md->roots[i], *this);
+        if(base_md->roots[i]!=nullptr && compacting) {
+            mark_ref(static_cast<char*>(base_md->roots[i]), ralloc::roots_type[i],
+                &base_md->roots[i], REF_CROSS);
+        } else if(base_md->roots[i]!=nullptr) {
+            mark_typed(static_cast<char*>(base_md->roots[i]), ralloc::roots_type[i]);
         }
     }
 
     if (pointers_xiaoxiang!=NULL && pointers_count_xiaoxiang>0){
-        printf("xiaoxiang: check %p %d...",pointers_xiaoxiang,pointers_count_xiaoxiang);
+        GC_LOG(2, "xiaoxiang: check %p %d...",pointers_xiaoxiang,pointers_count_xiaoxiang);
 //        printf("xiaoxiang inserting pointers...");
         for (int xx=0;xx<pointers_count_xiaoxiang;xx++){
             if (pointers_xiaoxiang[xx]!=NULL){
-                mark_func(pointers_xiaoxiang[xx]);
+                // every live block is listed, so they aren't traced
+                insert_block(reinterpret_cast<char*>(pointers_xiaoxiang[xx]));
             }
         }
     }
 
+    // then trace from them in parallel
+    mark_parallel();
+    GC_LOG(2, "Done!\n");
+}
 
-    while(!to_filter_node.empty()) {
-        // pop nodes from the stack and call filter function of each node
-        auto func = to_filter_func.top();
-        auto node = to_filter_node.top();
-        to_filter_node.pop();
-        to_filter_func.pop();
-        func(node,*this);
+void GarbageCollection::record_marks(){
+    uint64_t marked_num = inserted_num.load();
+    uint64_t marked_bytes = inserted_bytes.load();
+    for(int i = 0; i < thread_num; i++) {
+        marked_num += deques[i].marked_num;
+        marked_bytes += deques[i].marked_bytes;
     }
-    printf("Done!\nReachable blocks = %lu\n", marked_blk.size());
+    recovery_stats.thread_num = thread_num;
+    recovery_stats.reachable_blocks = marked_num;
+    recovery_stats.reachable_bytes = marked_bytes;
+    GC_LOG(1, "Reachable blocks = %lu\n", marked_num);
+    GC_LOG(1, "Mark bits = %lu KB\n", mark_bytes / 1024);
+    GC_LOG(1, "Time elapsed = %lu ms on mark.\n", recovery_stats.mark_us / 1000);
+}
+
+void GarbageCollection::record_sweep(const SweepCounts& counts){
+    recovery_stats.reclaimed_bytes = counts.reclaimed;
+    recovery_stats.sb_full = counts.state_num[SB_FULL];
+    recovery_stats.sb_partial = counts.state_num[SB_PARTIAL];
+    recovery_stats.sb_empty = counts.state_num[SB_EMPTY];
+    GC_LOG(1, "Superblocks: %lu full, %lu partial, %lu empty; %lu KB reclaimed\n",
+        counts.state_num[SB_FULL], counts.state_num[SB_PARTIAL],
+        counts.state_num[SB_EMPTY], counts.reclaimed / 1024);
+}
+
+/*
+ * function GarbageCollection::operator()
+ * 
+ * Description:
+ *  Stop-the-world garbage collection routine for Ralloc when dirty segment
+ *  exists. Both marking and sweeping are parallel.
+ */
+void GarbageCollection::operator() () {
+    GC_LOG(2, "Start garbage collection...\n");
+    auto gc_start = high_resolution_clock::now();
+    init_transient();
+    mark_all();
+    recovery_stats.kind = RP_RECOVERY_GC;
+    recovery_stats.mark_us = us_since(gc_start);
+    record_marks();
+    sweep_all(gc_start);
+}
+
+void GarbageCollection::sweep_all(high_resolution_clock::time_point gc_start){
     auto start = high_resolution_clock::now();
 
     // Step 2: sweep phase, update variables.
-    printf("Reconstructing metadata...");
-    char* curr_sb = _rgs->translate(SB_IDX, reinterpret_cast<char*>(SBSIZE)); // starting from first sb
-    Descriptor* curr_desc = base_md->desc_lookup(curr_sb);
-    auto curr_marked_blk = marked_blk.begin();
-    char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
-    Descriptor* avail_sb = nullptr; // head of new free sb list
+    GC_LOG(2, "Reconstructing metadata with %d threads...", thread_num);
+    SweepChains* chains = new SweepChains[thread_num]();
+    // each thread sweeps chunks of sbs, collects free sbs and partial sbs
+    // in private chains, and writes back what it rebuilt
+#pragma omp parallel num_threads(thread_num)
+    {
+        SweepChains& c = chains[omp_get_thread_num()];
+        PbufSite thread_site(PBUF_SITE_RECOVERY);
+#pragma omp for schedule(dynamic, SWEEP_CHUNK)
+        for(uint64_t i = 1; i < sb_num; i++) {
+            int state;
+            Descriptor* desc = sweep_sb(i, state, c.counts);
+            if(desc != nullptr) c.link(desc, state);
+        }
+        pbuf_commit();
+        pbuf_accumulate();
+    }
+    publish_chains(chains);
+    SweepCounts counts = {};
+    for(int t = 0; t < thread_num; t++) counts.add(chains[t].counts);
+    delete[] chains;
+    GC_LOG(2, "Reconstructed! \n");
+    recovery_stats.sweep_us = us_since(start);
+    record_sweep(counts);
+    GC_LOG(1, "Time elapsed = %lu ms on GC.\n", recovery_stats.sweep_us / 1000);
+    start = high_resolution_clock::now();
+
+    GC_LOG(2, "Flushing recovered data...");
+    // sbs were written back by the sweeping threads
+    // flush values in BaseMeta, including avail_sb and partial lists
+    pbuf_add(base_md, sizeof(BaseMeta));
+    pbuf_commit();
+    recovery_stats.flush_us = us_since(start);
+    recovery_stats.total_us = us_since(gc_start);
+    GC_LOG(1, "Time elapsed = %lu ms on flush.\n", recovery_stats.flush_us / 1000);
+    GC_LOG(2, "Garbage collection Completed!\n");
+}
 
-    // go through all sb in the region
-    while(curr_sb < sb_end) {
-        Anchor anchor(0, 0, SB_EMPTY);
-        char* free_blocks_head = nullptr;
-        char* last_possible_free_block = curr_sb;
-
-        // go through all curr_marked_blk that's in this sb
-        while (curr_marked_blk!=marked_blk.end() && 
-                ((uint64_t)curr_sb>>SB_SHIFT) == ((uint64_t)(*curr_marked_blk)>>SB_SHIFT)) 
-        { 
-            // curr_marked_blk doesn't reach the end of marked_blk and curr_marked_blk is in curr_sb
-
-            if(curr_desc->heap != nullptr &&
-                curr_desc->superblock == curr_sb) {
-                // false positive shouldn't enter here
-                if(curr_desc->heap->sc_idx == 0) {
-                    // large sb that's in use
-                    // assert((*curr_marked_blk) == curr_sb); //allow large sb
-                    // to be pointed at in the middle
-                    assert(curr_desc->maxcount == 1);
-                    anchor.state = SB_FULL; // set it as full
-                } 
-                else {
-                    // small sb that's in use
-                    anchor.state = SB_PARTIAL;
-                    for(char* free_block = last_possible_free_block; 
-                        free_block < (*curr_marked_blk); free_block+=curr_desc->block_size){
-                        // put last_possible_free_block...(curr_marked_blk-1) to free blk list
-                        (*reinterpret_cast<pptr<char>*>(free_block)) = free_blocks_head;
-                        free_blocks_head = free_block;
-                        anchor.count++;
-                    }
-                    last_possible_free_block = (*curr_marked_blk)+curr_desc->block_size;
+// number of blocks or fields handed to a moving thread at a time
+static const uint64_t MOVE_CHUNK = 256;
+
+/*
+ * function GarbageCollection::compact()
+ *
+ * Description:
+ *  Offline GC that moves blocks between marking and sweeping. Blocks are
+ *  moved within their size class, from the emptiest sbs into free blocks of
+ *  pinned and the fullest sbs, as long as the source can be emptied. Moving
+ *  only rewrites mark bits, so the sweep rebuilds metadata as usual.
+ */
+void GarbageCollection::compact(){
+    GC_LOG(2, "Start compacting garbage collection...\n");
+    auto gc_start = high_resolution_clock::now();
+    compacting = true;
+    init_transient();
+    mark_all();
+    recovery_stats.kind = RP_RECOVERY_COMPACT;
+    recovery_stats.mark_us = us_since(gc_start);
+    record_marks();
+    auto start = high_resolution_clock::now();
+
+    GC_LOG(2, "Moving blocks with %d threads...", thread_num);
+    std::vector<uint64_t> sbs[MAX_SZ_IDX];
+    for(uint64_t i = 1; i < sb_num; i++) {
+        const SbMarks& m = sb_marks[i];
+        if(m.sc_idx != 0 && m.start == sb_base + (i << SB_SHIFT))
+            sbs[m.sc_idx].push_back(i);
+    }
+    std::vector<Move> planned[MAX_SZ_IDX];
+    uint64_t pinned_num = 0;
+#pragma omp parallel for num_threads(thread_num) schedule(dynamic, 1) reduction(+:pinned_num)
+    for(int sc = 1; sc < MAX_SZ_IDX; sc++) {
+        pinned_num += plan_moves(sbs[sc], planned[sc]);
+    }
+    moved_sb.assign(sb_num, 0);
+    uint64_t moved_bytes = 0;
+    for(int sc = 1; sc < MAX_SZ_IDX; sc++) {
+        for(const Move& mv : planned[sc]) {
+            uint64_t i = (mv.from - sb_base) >> SB_SHIFT;
+            moved_sb[i] = 1;
+            moved_bytes += sb_marks[i].block_size;
+            moves.push_back(mv);
+        }
+    }
+    std::sort(moves.begin(), moves.end(),
+        [](const Move& a, const Move& b){ return a.from < b.from; });
+    move_blocks();
+    GC_LOG(2, "Moved!\n");
+    recovery_stats.moved_blocks = moves.size();
+    recovery_stats.moved_bytes = moved_bytes;
+    recovery_stats.pinned_blocks = pinned_num;
+    GC_LOG(1, "Moved %lu blocks (%lu KB); %lu blocks pinned\n",
+        moves.size(), moved_bytes / 1024, pinned_num);
+    shrink_region();
+    recovery_stats.move_us = us_since(start);
+    GC_LOG(1, "%lu KB of sb region released\n", recovery_stats.released_bytes / 1024);
+    GC_LOG(1, "Time elapsed = %lu ms on move.\n", recovery_stats.move_us / 1000);
+    sweep_all(gc_start);
+}
+
+uint64_t GarbageCollection::plan_moves(const std::vector<uint64_t>& sbs,
+    std::vector<Move>& planned){
+    // live blocks of an sb in use
+    struct SbLive {
+        uint64_t i;
+        uint32_t live;
+    };
+    std::vector<SbLive> dsts; // sbs with pinned blocks first
+    std::vector<SbLive> movable;
+    uint64_t pinned_num = 0;
+    for(uint64_t i : sbs) {
+        const SbMarks& m = sb_marks[i];
+        uint32_t live = 0;
+        uint32_t pinned = 0;
+        for(uint32_t b = 0; b < m.maxcount; b += 64) {
+            uint64_t word = marks_at(m.bit + b);
+            if(m.maxcount - b < 64) word &= (1ULL << (m.maxcount - b)) - 1;
+            live += __builtin_popcountll(word);
+            pinned += __builtin_popcountll(word & bits_at(pin_bits, m.bit + b));
+        }
+        pinned_num += pinned;
+        if(live == 0) continue;
+        if(pinned != 0) dsts.push_back({i, live});
+        else movable.push_back({i, live});
+    }
+    // fill the fullest sbs with blocks of the emptiest
+    std::sort(movable.begin(), movable.end(),
+        [](const SbLive& a, const SbLive& b){ return a.live > b.live; });
+    size_t const fixed_num = dsts.size();
+    dsts.insert(dsts.end(), movable.begin(), movable.end());
+    if(dsts.size() < 2 || movable.empty()) return pinned_num;
+    uint32_t const maxcount = sb_marks[dsts[0].i].maxcount;
+    uint64_t const block_size = sb_marks[dsts[0].i].block_size;
+    // free blocks in sbs before the source
+    size_t s = dsts.size() - 1;
+    uint64_t room = 0;
+    for(size_t k = 0; k < s; k++) room += maxcount - dsts[k].live;
+    size_t d = 0;
+    uint32_t slot = 0;
+    // a source is moved only if it can be emptied
+    while(s >= fixed_num && d < s && room >= dsts[s].live) {
+        const SbMarks& src = sb_marks[dsts[s].i];
+        for(uint32_t b = 0; b < maxcount; b++) {
+            if(!is_marked(src.bit + b)) continue;
+            while(is_marked(sb_marks[dsts[d].i].bit + slot)) {
+                if(++slot == maxcount) {
+                    d++;
+                    slot = 0;
                 }
             }
-            curr_marked_blk++;
+            const SbMarks& dst = sb_marks[dsts[d].i];
+            // words may be shared with sbs of other size classes
+            mark_bits[(dst.bit + slot) / 64].fetch_or(1ULL << ((dst.bit + slot) % 64));
+            mark_bits[(src.bit + b) / 64].fetch_and(~(1ULL << ((src.bit + b) % 64)));
+            planned.push_back({src.start + b * block_size, dst.start + slot * block_size});
         }
-        if(anchor.state == SB_EMPTY) {
-            // curr_sb isn't in use
-            new (curr_desc) Descriptor();
-            curr_desc->next_free.store(avail_sb);
-            avail_sb = curr_desc;
-            curr_sb+=SBSIZE;
-            curr_desc++;
-        } else {
-            if(curr_desc->heap->sc_idx == 0) {
-                // large sb that's in use
+        room -= dsts[s].live;
+        s--;
+        room -= maxcount - dsts[s].live;
+    }
+    return pinned_num;
+}
 
-                anchor.avail = 0;
-                anchor.count = 0;
-                anchor.state = SB_FULL;
+char* GarbageCollection::forward(char* ptr){
+    if(!_rgs->in_range(SB_IDX, ptr)) return ptr;
+    uint64_t i = (uint64_t)(ptr - sb_base) >> SB_SHIFT;
+    if(i >= moved_sb.size() || moved_sb[i] == 0) return ptr;
+    uint64_t bit;
+    char* blk = find_block(ptr, bit);
+    if(blk == nullptr) return ptr;
+    auto it = std::lower_bound(moves.begin(), moves.end(), blk,
+        [](const Move& mv, char* b){ return mv.from < b; });
+    if(it == moves.end() || it->from != blk) return ptr;
+    return it->to + (ptr - blk);
+}
 
-                // set transient variables in curr_desc
-                curr_desc->next_free.store(nullptr);
-                curr_desc->next_partial.store(nullptr);
-                curr_desc->anchor.store(anchor);
+// point field of kind to target and add it to the persist buffer
+static inline void rewrite_field(void* field, char* target, uint32_t kind){
+    if(kind == GarbageCollection::REF_CROSS)
+        *reinterpret_cast<CrossPtr<char, SB_IDX>*>(field) = target;
+    else
+        *reinterpret_cast<pptr<char>*>(field) = target;
+    pbuf_add(field, sizeof(uint64_t));
+}
 
-                // move curr_sb to the sb next to this large sb
-                curr_sb+=curr_desc->block_size;
-                curr_desc = base_md->desc_lookup(curr_sb);
-            } else {
-                // small sb that's in use
-                for(char* free_block = last_possible_free_block; 
-                    free_block < curr_sb+curr_desc->maxcount*curr_desc->block_size; free_block+=curr_desc->block_size){
-                    // put last_possible_free_block...(curr_sb+SBSIZE-1) to free blk list
-                    (*reinterpret_cast<pptr<char>*>(free_block)) = free_blocks_head;
-                    free_blocks_head = free_block;
-                    anchor.count++;
-                }
-                if(anchor.count == 0) { 
-                    // this sb is fully used
-                    anchor.avail = curr_desc->maxcount;
-                    anchor.state = SB_FULL;
-
-                    // set transient variables in curr_desc
-                    curr_desc->next_free.store(nullptr);
-                    curr_desc->next_partial.store(nullptr);
-                    curr_desc->anchor.store(anchor);
-                } else {
-                    // this sb is partially used
-                    assert(free_blocks_head != nullptr);
-                    assert((uint64_t)(free_blocks_head - curr_sb)%curr_desc->block_size == 0);
-                    anchor.avail = (uint64_t)(free_blocks_head - curr_sb)/curr_desc->block_size;
-                    anchor.state = SB_PARTIAL; // it must be SB_PARTIAL already but we assign it anyway
-
-                    // set transient variables in curr_desc
-                    curr_desc->next_free.store(nullptr);
-                    base_md->heap_push_partial(curr_desc);
-                    curr_desc->anchor.store(anchor);
-                }
-                // move curr_sb and curr_desc to next sb
-                curr_sb+=SBSIZE;
-                curr_desc++;
+void GarbageCollection::move_blocks(){
+#pragma omp parallel num_threads(thread_num)
+    {
+        PbufSite thread_site(PBUF_SITE_RECOVERY);
+        // copies are unreachable until fields of blocks that stay point to
+        // them, so they and fields in them are written back first
+#pragma omp for schedule(dynamic, MOVE_CHUNK)
+        for(uint64_t k = 0; k < moves.size(); k++) {
+            uint64_t size = sb_marks[(moves[k].from - sb_base) >> SB_SHIFT].block_size;
+            memcpy(moves[k].to, moves[k].from, size);
+            pbuf_add(moves[k].to, size);
+        }
+        for(int t = 0; t < thread_num; t++) {
+            std::vector<FieldRef>& refs = deques[t].refs;
+#pragma omp for schedule(dynamic, MOVE_CHUNK)
+            for(uint64_t k = 0; k < refs.size(); k++) {
+                char* field = forward(reinterpret_cast<char*>(refs[k].field));
+                if(field != refs[k].field)
+                    rewrite_field(field, forward(refs[k].target), refs[k].kind);
+            }
+        }
+        pbuf_commit();
+#pragma omp barrier
+        // then each field that stays is a single word to rewrite
+        for(int t = 0; t < thread_num; t++) {
+            std::vector<FieldRef>& refs = deques[t].refs;
+#pragma omp for schedule(dynamic, MOVE_CHUNK)
+            for(uint64_t k = 0; k < refs.size(); k++) {
+                char* field = reinterpret_cast<char*>(refs[k].field);
+                char* target = forward(refs[k].target);
+                if(forward(field) == field && target != refs[k].target)
+                    rewrite_field(field, target, refs[k].kind);
             }
         }
+        pbuf_commit();
+        pbuf_accumulate();
+    }
+}
+
+void GarbageCollection::shrink_region(){
+    // sbs after the last one in use
+    uint64_t end = sb_num;
+    while(end > 1) {
+        const SbMarks& m = sb_marks[end - 1];
+        if(m.start != nullptr && any_marked(m.bit, m.maxcount)) break;
+        end--;
+    }
+    RegionManager* region = _rgs->regions[SB_IDX];
+    char* old_end = region->curr_addr_ptr->load();
+    char* new_end = sb_base + (end << SB_SHIFT);
+    if(new_end >= old_end) return;
+    for(uint64_t i = end; i < sb_num; i++)
+        new (base_md->desc_lookup(sb_base + (i << SB_SHIFT))) Descriptor();
+    pbuf_commit();
+    // punch out the rest of the file, which then reads as zero, before it's
+    // taken as fresh
+    uint64_t off = new_end - region->base_addr;
+    if(fallocate(region->FD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        off, region->FILESIZE - off) != 0) {
+        GC_LOG(1, "Failed to release sb region: %s\n", strerror(errno));
+        return;
+    }
+    base_md->fresh_sb.store((uint64_t)_rgs->untranslate(SB_IDX, new_end));
+    pbuf_add(&base_md->fresh_sb, sizeof(base_md->fresh_sb));
+    region->curr_addr_ptr->store(new_end);
+    pbuf_add(region->curr_addr_ptr, sizeof(atomic_pptr<char>));
+    pbuf_commit();
+    recovery_stats.released_bytes = old_end - new_end;
+    sb_num = end;
+}
+
+void GarbageCollection::publish_chains(SweepChains* chains){
+    Descriptor* avail_sb = nullptr; // head of new free sb list
+    Descriptor* avail_tail = nullptr;
+    for(int t = 0; t < thread_num; t++) {
+        if(chains[t].avail_head == nullptr) continue;
+        if(avail_tail == nullptr) avail_sb = chains[t].avail_head;
+        else avail_tail->next_free.store(chains[t].avail_head);
+        avail_tail = chains[t].avail_tail;
+    }
+    for(int sc = 1; sc < MAX_SZ_IDX; sc++) {
+        Descriptor* head = nullptr;
+        Descriptor* tail = nullptr;
+        for(int t = 0; t < thread_num; t++) {
+            if(chains[t].partial_head[sc] == nullptr) continue;
+            if(tail == nullptr) head = chains[t].partial_head[sc];
+            else tail->next_partial.store(chains[t].partial_head[sc]);
+            tail = chains[t].partial_tail[sc];
+        }
+        ptr_cnt<Descriptor> tmp_partial(head, 0);
+        base_md->heaps[sc].partial_list.store(tmp_partial);
     }
     // store head of new free sb list into base_md
     ptr_cnt<Descriptor> tmp_avail_sb(avail_sb, 0);
     base_md->avail_sb.store(tmp_avail_sb);
-    printf("Reconstructed! \n");
-    auto stop = high_resolution_clock::now(); 
-    assert(curr_marked_blk == marked_blk.end());
-    auto duration = duration_cast<milliseconds>(stop - start);
-    cout << "Time elapsed = " << duration.count() <<" ms on GC."<<endl;
+}
 
+#ifdef SB_BITMAP
+Descriptor* GarbageCollection::restore_sb(uint64_t i, uint64_t epoch, int& state,
+    bool& changed){
+    char* curr_sb = sb_base + (i << SB_SHIFT);
+    Descriptor* curr_desc = base_md->desc_lookup(curr_sb);
+    Anchor anchor(0, 0, SB_FULL);
+    if(curr_desc->heap == nullptr || curr_desc->superblock != curr_sb) {
+        // curr_sb isn't in use
+        new (curr_desc) Descriptor();
+        state = SB_EMPTY;
+        return curr_desc;
+    }
+    uint32_t const maxcount = curr_desc->maxcount;
+    if(curr_desc->heap->sc_idx != 0) {
+        // blocks of a changed sb may have been handed out since, so all are
+        // taken as in use
+        changed = curr_desc->epoch.load(memory_order_relaxed) >= epoch;
+        std::atomic<uint64_t>* bitmap = base_md->bitmap_lookup(curr_desc);
+        std::atomic<uint64_t>* saved = base_md->ckpt_lookup(curr_desc, epoch);
+        uint32_t const word_num = (maxcount + 63) / 64;
+        for(uint32_t w = 0; w < word_num; w++) {
+            uint64_t word = changed ? 0 : saved[w].load(memory_order_relaxed);
+            bitmap[w].store(word, memory_order_relaxed);
+            anchor.count += __builtin_popcountll(word);
+        }
+        pbuf_add(bitmap, word_num * sizeof(uint64_t));
+        if(anchor.count == maxcount) {
+            new (curr_desc) Descriptor();
+            state = SB_EMPTY;
+            return curr_desc;
+        }
+        if(anchor.count == 0)
+            anchor.avail = maxcount;
+        else
+            anchor.state = SB_PARTIAL;
+    }
+    curr_desc->next_free.store(nullptr);
+    curr_desc->next_partial.store(nullptr);
+    curr_desc->anchor.store(anchor);
+    pbuf_add(curr_desc, sizeof(Descriptor));
+    state = anchor.state;
+    return curr_desc;
+}
 
-    printf("Flushing recovered data...");
-    _rgs->flush_region(DESC_IDX);
-    _rgs->flush_region(SB_IDX);
-    char* addr_to_flush = reinterpret_cast<char*>(base_md);
-    // flush values in BaseMeta, including avail_sb and partial lists
-    for(size_t i = 0; i < sizeof(BaseMeta); i += CACHELINE_SIZE) {
-        addr_to_flush += CACHELINE_SIZE;
-        FLUSH(addr_to_flush);
+void GarbageCollection::from_checkpoint(uint64_t epoch){
+    GC_LOG(2, "Start recovery from checkpoint %lu...\n", epoch);
+    auto start = high_resolution_clock::now();
+    init_transient();
+    if(thread_num <= 0) thread_num = omp_get_max_threads();
+    sb_base = _rgs->lookup(SB_IDX);
+    char* sb_end = _rgs->regions[SB_IDX]->curr_addr_ptr->load();
+    sb_num = ((uint64_t)(sb_end - sb_base) + SBSIZE - 1) >> SB_SHIFT;
+    // first sb of each block; other sbs of a large block are left as is.
+    // sb 0 is never handed out.
+    std::vector<uint64_t> firsts;
+    uint64_t i = 1;
+    while(i < sb_num) {
+        char* sb = sb_base + (i << SB_SHIFT);
+        Descriptor* desc = base_md->desc_lookup(sb);
+        firsts.push_back(i);
+        if(desc->heap != nullptr && desc->superblock == sb && desc->heap->sc_idx == 0)
+            i += (desc->block_size + SBSIZE - 1) >> SB_SHIFT;
+        else
+            i++;
+    }
+
+    GC_LOG(2, "Restoring metadata with %d threads...", thread_num);
+    SweepChains* chains = new SweepChains[thread_num]();
+    uint64_t changed_num = 0;
+#pragma omp parallel num_threads(thread_num) reduction(+:changed_num)
+    {
+        SweepChains& c = chains[omp_get_thread_num()];
+        PbufSite thread_site(PBUF_SITE_RECOVERY);
+#pragma omp for schedule(dynamic, SWEEP_CHUNK)
+        for(uint64_t k = 0; k < firsts.size(); k++) {
+            int state;
+            bool changed = false;
+            Descriptor* desc = restore_sb(firsts[k], epoch, state, changed);
+            c.link(desc, state);
+            c.counts.state_num[state]++;
+            changed_num += changed;
+        }
+        pbuf_commit();
+        pbuf_accumulate();
     }
-    FLUSHFENCE;
-    printf("Garbage collection Completed!\n");
+    publish_chains(chains);
+    SweepCounts counts = {};
+    for(int t = 0; t < thread_num; t++) counts.add(chains[t].counts);
+    delete[] chains;
+    // free blocks of changed sbs are left for the next GC
+    if(changed_num != 0)
+        base_md->ckpt_leaky = true;
+    recovery_stats.sweep_us = us_since(start);
+    auto flush_start = high_resolution_clock::now();
+    pbuf_add(base_md, sizeof(BaseMeta));
+    pbuf_commit();
+    recovery_stats.kind = RP_RECOVERY_CHECKPOINT;
+    recovery_stats.thread_num = thread_num;
+    recovery_stats.flush_us = us_since(flush_start);
+    recovery_stats.total_us = us_since(start);
+    GC_LOG(2, "Restored!\n");
+    GC_LOG(1, "%lu small sbs changed since checkpoint %lu.\n", changed_num, epoch);
+    record_sweep(counts);
+    GC_LOG(1, "Time elapsed = %lu ms on recovery.\n", recovery_stats.total_us / 1000);
 }
+#endif
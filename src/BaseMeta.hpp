@@ -14,13 +14,15 @@
 #ifndef _BASE_META_HPP_
 #define _BASE_META_HPP_
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
-#include <functional>
-#include <set>
 #include <vector>
-#include <stack>
 #include <utility>
+#include <thread>
+#include <mutex>
 #include <pthread.h>
 
 #include "pm_config.hpp"
@@ -65,6 +67,8 @@
  */
 
 class BaseMeta;
+struct RP_recovery_stats;
+struct RP_check_report;
 namespace ralloc{
     /* manager to map, remap, and unmap the heap */
     // regions manager
@@ -76,6 +80,12 @@ namespace ralloc{
     // function to flush thread-local cache, used in TCaches::~TCaches and
     // BaseMeta::writeback()
     extern void public_flush_cache();
+    // what the last recovery did, filled in by GarbageCollection
+    extern RP_recovery_stats recovery_stats;
+    // GC prints a summary of each recovery at 1, and its progress at 2
+    extern int verbose;
+    // blocks each marking thread prefetches ahead, up to MARK_FIFO_SIZE
+    extern uint32_t mark_prefetch;
 };
 
 /* 
@@ -255,6 +265,10 @@ struct Descriptor {
     RP_PERSIST CrossPtr<ProcHeap, META_IDX> heap;
     RP_PERSIST uint32_t block_size; // block size acquired from sc
     RP_PERSIST uint32_t maxcount; // block number acquired from sc
+#ifdef SB_BITMAP
+    // latest checkpoint epoch in which the sb changed; see BaseMeta::checkpoint
+    RP_PERSIST std::atomic<uint64_t> epoch;
+#endif
     Descriptor() noexcept :
         next_free(),
         next_partial(),
@@ -262,9 +276,14 @@ struct Descriptor {
         superblock(),
         heap(),
         block_size(),
+#ifdef SB_BITMAP
+        maxcount(),
+        epoch(0){
+#else
         maxcount(){
-            FLUSH(this);
-            FLUSHFENCE;
+#endif
+            // committed by the caller before the superblock is handed out
+            pbuf_add(this, sizeof(Descriptor));
         };
 }__attribute__((aligned(CACHELINE_SIZE)));
 static_assert(sizeof(Descriptor) == CACHELINE_SIZE, "Invalid Descriptor size");
@@ -297,65 +316,376 @@ public:
  *  A function class to do garbage collection during a dirty restart.
  *  Will be instantiated when BaseMeta::restart() is called and the segment is
  *  dirty.
+ *
+ *  Marking runs on thread_num threads (0 for omp_get_max_threads()). Each
+ *  thread owns a MarkDeque of blocks to trace and steals from the front of
+ *  others' when its own is empty. Blocks are marked by setting their bit in
+ *  mark_bits, so each reachable block is traced exactly once whichever thread
+ *  finds it first.
+ *
+ *  In lazy mode (start_lazy()), only marking is done before the heap is
+ *  handed back. Superblocks are then swept by a background thread, or on
+ *  demand by a thread that frees into one or needs blocks of its size class;
+ *  sweep_state tells which are done. Until then, allocations are served from
+ *  swept superblocks and fresh region space.
+ *
+ *  from_checkpoint() rebuilds superblocks from a checkpoint instead, see
+ *  BaseMeta::checkpoint().
+ *
+ *  compact() moves live blocks before the sweep, so that each size class
+ *  fills as few superblocks as possible, and gives back the tail of the sb
+ *  region. pptr is self-relative, so a block can move only if every pptr to
+ *  it and in it is known. Filter functions tell those by mark_field(), which
+ *  records where each one is. Blocks reached otherwise, by mark_func() or
+ *  conservatively, are pinned, and so are blocks whose filter functions do
+ *  either. Blocks reached from more than one field are pinned too, so that
+ *  every state of a compaction interrupted by a crash is a valid heap with
+ *  no block duplicated: moved blocks are copied and their fields rewritten
+ *  first, and only then are fields of blocks that stay pointed to the
+ *  copies, one word each.
  */
 class GarbageCollection{
 public:
-    std::set<char*> marked_blk;
-    std::stack<char*> to_filter_node;
-    std::stack<std::function<void(char*,GarbageCollection& gc)>> to_filter_func;
+    // a block to trace and the type id of its tracer
+    struct MarkItem {
+        char* ptr;
+        uint64_t type;
+    };
+
+    // a field marked by mark_field(), pointing to target, for compact()
+    struct FieldRef {
+        void* field;
+        char* target;
+        uint32_t kind;
+    };
+    // kinds of FieldRef
+    enum : uint32_t {
+        REF_PPTR = 0, // pptr or atomic_pptr
+        REF_CROSS, // CrossPtr<T, SB_IDX>, e.g. a root
+    };
+    // a block moved by compact()
+    struct Move {
+        char* from;
+        char* to;
+    };
+
+    /*
+     * Work-stealing deque of a marking thread. The owner pushes and pops at
+     * the back, and thieves take the oldest items, closest to roots, from the
+     * front. Both ends share a spinlock.
+     *
+     * In front of it, the owner keeps a small FIFO of blocks it prefetched.
+     * New items and items popped from the deque enter at its tail and are
+     * traced from its head, so a block is loaded while the ones queued before
+     * it are traced, and branches of several chains are in flight at once.
+     */
+    struct MarkDeque {
+        std::atomic_flag lk = ATOMIC_FLAG_INIT;
+        std::deque<MarkItem> items;
+        // size of items, for thieves to skip empty deques without locking
+        std::atomic<uint64_t> item_num{0};
+        // prefetched items, only touched by the owner
+        MarkItem fifo[MARK_FIFO_SIZE];
+        uint32_t fifo_head = 0;
+        uint32_t fifo_num = 0;
+        inline void fifo_push(const MarkItem& item){
+            __builtin_prefetch(item.ptr);
+            fifo[(fifo_head + fifo_num++) % MARK_FIFO_SIZE] = item;
+        }
+        inline MarkItem fifo_pop(){
+            MarkItem item = fifo[fifo_head];
+            fifo_head = (fifo_head + 1) % MARK_FIFO_SIZE;
+            fifo_num--;
+            return item;
+        }
+        // number of blocks marked by this thread, and their bytes
+        uint64_t marked_num = 0;
+        uint64_t marked_bytes = 0;
+        // block being traced and fields marked by mark_field(), if compacting
+        char* tracing = nullptr;
+        std::vector<FieldRef> refs;
+        inline void lock(){ while(lk.test_and_set(std::memory_order_acquire)); }
+        inline void unlock(){ lk.clear(std::memory_order_release); }
+    }__attribute__((aligned(CACHELINE_SIZE)));
+
+    // sbs swept into each anchor state, and bytes of free blocks in sbs
+    // that were in use
+    struct SweepCounts {
+        uint64_t state_num[SB_EMPTY + 1];
+        uint64_t reclaimed;
+        void add(const SweepCounts& c){
+            for(int s = 0; s <= SB_EMPTY; s++) state_num[s] += c.state_num[s];
+            reclaimed += c.reclaimed;
+        }
+    };
+
+    // free and partial sbs found by a sweeping thread, linked through
+    // next_free and next_partial
+    struct SweepChains {
+        Descriptor* avail_head;
+        Descriptor* avail_tail;
+        Descriptor* partial_head[MAX_SZ_IDX];
+        Descriptor* partial_tail[MAX_SZ_IDX];
+        SweepCounts counts;
+        // link desc swept into state
+        void link(Descriptor* desc, int state);
+    };
+
+    // mark bit layout of a superblock
+    struct SbMarks {
+        char* start; // first sb of the (large) block; nullptr if sb is unused
+        uint64_t bit; // index of the first mark bit of the sb
+        uint64_t block_size;
+        uint32_t sc_idx;
+        uint32_t maxcount;
+    };
 
     void** pointers_xiaoxiang= nullptr;
     int pointers_count_xiaoxiang= 0;
 
-    GarbageCollection():marked_blk(){};
+    GarbageCollection(int _thread_num = 0):
+        thread_num(_thread_num),
+        prefetch_depth(std::min(ralloc::mark_prefetch, MARK_FIFO_SIZE)){};
+    ~GarbageCollection();
 
     void operator() ();
 
-    // return true if ptr is a valid and unmarked pointer, otherwise false
-    template<class T>
-    inline void mark_func(T* ptr){
-        void* addr = reinterpret_cast<void*>(ptr);
-        // Step 1: check if it's a valid pptr
-        if(UNLIKELY(!ralloc::_rgs->in_range(SB_IDX, addr))) {
-//            printf(" ### %p not in range ###\n",addr);
-//            throw; // return if not in range
-            return;
-        }
+    // mark, and leave the sweep to a background thread and on-demand calls
+    void start_lazy();
+    // wait for the background sweep
+    void finish_lazy();
+    inline bool is_lazy_pending(){
+        return lazy_pending.load(std::memory_order_acquire);
+    }
+    // sweep the sb ptr is in, if it isn't yet
+    void sweep_for(const void* ptr);
+    // sweep sbs in use of size class sc_idx until one has free blocks
+    void sweep_sc(size_t sc_idx);
+    // sweep all sbs not swept yet, and return once all are
+    void sweep_remaining();
+    // copy recovery_stats, which the background sweep may be filling in
+    void get_stats(RP_recovery_stats* stats);
+#ifdef SB_BITMAP
+    // rebuild sbs from checkpoint epoch without marking
+    void from_checkpoint(uint64_t epoch);
+#endif
+
+    /*
+     * mark the block ptr points into and return its start, or nullptr if ptr
+     * isn't in a block in use or the block is already marked. Only called
+     * by the threads of the parallel mark, which count it in their deques.
+     */
+    char* mark_block(char* ptr);
 
-        /**
-         * start xiaoxiang optimized version
-         */
+    /*
+     * mark the block ptr points into without tracing it, from outside the
+     * parallel mark; callers may run concurrently
+     */
+    void insert_block(char* ptr);
+
+    // mark the block ptr points to and trace it by tracer type later
+    inline void mark_typed(char* ptr, uint32_t type){
+        // where ptr is stored isn't known, so neither block can move
+        if(UNLIKELY(compacting)) pin_ref(ptr);
+        char* blk = mark_block(ptr);
+        if(blk == nullptr) return;
+        push(blk, type);
+    }
 
+    // mark the block ptr points to and trace it by filter_func<T> later
+    template<class T>
+    inline void mark_func(T* ptr);
 
-        // Step 2: mark potential pptr
-        marked_blk.insert(reinterpret_cast<char*>(addr));
-        return;
+    template<class T>
+    inline void filter_func(T* ptr);
 
+    /*
+     * mark the block field points into like mark_func(), and let compact()
+     * move it and rewrite field. Filter functions should mark every pptr
+     * in their blocks with these, or their blocks are pinned.
+     */
+    template<class T>
+    inline void mark_field(pptr<T>& field);
+    template<class T>
+    inline void mark_field(atomic_pptr<T>& field);
 
-        /**
-         * end
-         */
+    // GC that moves live blocks into as few sbs as possible before the sweep
+    void compact();
 
-        auto res = marked_blk.find(reinterpret_cast<char*>(addr));
-        if(res == marked_blk.end()){
-            // Step 2: mark potential pptr
-            marked_blk.insert(reinterpret_cast<char*>(addr));
-            // Step 3: push ptr to stack
-            to_filter_node.push(reinterpret_cast<char*>(addr));
-            to_filter_func.push([](char* ptr,GarbageCollection& gc){
-                    gc.filter_func(reinterpret_cast<T*>(ptr));
-                });
+    /*
+     * mark every 8-byte aligned word in [blk, blk+size) that looks like a
+     * pptr, conservatively. Words are tested by AVX-512 or AVX2 when the CPU
+     * has them, and only candidates are decoded.
+     */
+    void scan_conservative(char* blk, size_t size);
+
+private:
+    int thread_num;
+    // items kept in the FIFO of each MarkDeque; 0 traces from deques only
+    uint32_t prefetch_depth;
+    // set by compact() to record fields and pin blocks while marking
+    bool compacting = false;
+    // blocks compact() can't move, and blocks marked by mark_field(), by
+    // mark bit
+    std::atomic<uint64_t>* pin_bits = nullptr;
+    std::atomic<uint64_t>* ref_bits = nullptr;
+    // blocks moved by compact(), sorted by from, and sbs they are moved from
+    std::vector<Move> moves;
+    std::vector<uint8_t> moved_sb;
+    char* sb_base = nullptr;
+    uint64_t sb_num = 0;
+    SbMarks* sb_marks = nullptr;
+    std::atomic<uint64_t>* mark_bits = nullptr;
+    // memory used by mark bits and their layout
+    uint64_t mark_bytes = 0;
+
+    // lazy sweep state
+    enum : uint8_t { UNSWEPT = 0, SWEEPING, SWEPT };
+    std::atomic<uint8_t>* sweep_state = nullptr;
+    std::vector<uint64_t> sc_sbs[MAX_SZ_IDX];
+    std::atomic<uint64_t> sc_next[MAX_SZ_IDX] = {};
+    std::atomic<bool> lazy_pending{false};
+    std::thread sweeper;
+    // counts of lazy sweeps, which may run on any thread
+    SweepCounts lazy_counts = {};
+    std::mutex lazy_mtx;
+    MarkDeque* deques = nullptr;
+    // items pushed but not traced yet, to detect termination
+    std::atomic<int64_t> pending{0};
+    // blocks marked by insert_block(), and their bytes
+    std::atomic<uint64_t> inserted_num{0};
+    std::atomic<uint64_t> inserted_bytes{0};
+    std::once_flag marks_once;
+
+    // lay out mark bits over sbs in use; done before the first mark
+    void init_marks();
+    void init_transient();
+    // mark from roots and xiaoxiang pointers
+    void mark_all();
+    // record marked blocks and bytes in recovery_stats
+    void record_marks();
+    // record counts of sweep in recovery_stats
+    void record_sweep(const SweepCounts& counts);
+    inline bool is_marked(uint64_t bit){
+        return mark_bits[bit / 64].load(std::memory_order_relaxed) & (1ULL << (bit % 64));
+    }
+    // 64 bits of bits, laid out as mark bits, starting from bit
+    static inline uint64_t bits_at(std::atomic<uint64_t>* bits, uint64_t bit){
+        uint64_t lo = bits[bit / 64].load(std::memory_order_relaxed) >> (bit % 64);
+        if(bit % 64 == 0) return lo;
+        // they have a spare word at the end for this
+        return lo | (bits[bit / 64 + 1].load(std::memory_order_relaxed) << (64 - bit % 64));
+    }
+    // 64 mark bits starting from bit
+    inline uint64_t marks_at(uint64_t bit){
+        return bits_at(mark_bits, bit);
+    }
+    // whether any of num bits starting from bit is set
+    inline bool any_marked(uint64_t bit, uint64_t num){
+        for(uint64_t i = 0; i < num; i += 64) {
+            uint64_t word = marks_at(bit + i);
+            if(num - i < 64) word &= (1ULL << (num - i)) - 1;
+            if(word != 0) return true;
         }
-        return;
+        return false;
     }
-
-    template<class T>
-    inline void filter_func(T* ptr);
+    // find the block ptr points into and set bit to its mark bit; return
+    // nullptr if ptr isn't in a block of an sb in use
+    char* find_block(char* ptr, uint64_t& bit);
+    // mark_field() while compacting
+    void mark_ref(char* ptr, uint32_t type, void* field, uint32_t kind);
+    // pin the block ptr points into, if any
+    void pin(char* ptr);
+    // pin the block ptr points into, and the block being traced
+    void pin_ref(char* ptr);
+    // where ptr points to after compaction
+    char* forward(char* ptr);
+    // pick blocks of sbs of a size class to move and move their mark bits;
+    // return the number of pinned blocks in them
+    uint64_t plan_moves(const std::vector<uint64_t>& sbs, std::vector<Move>& planned);
+    // copy moved blocks and rewrite fields marked by mark_field()
+    void move_blocks();
+    // give back sbs in the tail of the region that are free after moves
+    void shrink_region();
+    // sweep and flush after marking; part of operator()
+    void sweep_all(std::chrono::high_resolution_clock::time_point gc_start);
+    void push(char* blk, uint32_t type);
+    bool pop(int tid, MarkItem& item);
+    bool steal(int tid, MarkItem& item);
+    // next item for thread tid to trace: from its FIFO, topped up from its
+    // deque, or else stolen
+    bool next_item(int tid, MarkItem& item);
+    // trace from pushed blocks until no thread has work left
+    void mark_parallel();
+    // number of sbs handed to a sweeping thread at a time
+    static const uint64_t SWEEP_CHUNK = 64;
+    /*
+     * rebuild sb i from its mark bits and write it back, then return its
+     * descriptor and set state to its anchor state; return nullptr if it's
+     * part of a large block done with its first sb. sb i is added to counts.
+     */
+    Descriptor* sweep_sb(uint64_t i, int& state, SweepCounts& counts);
+    // sweep sb i unless done and return true if it's partial; wait if
+    // another thread is sweeping it
+    bool lazy_sweep_sb(uint64_t i);
+    void lazy_sweeper();
+    // concatenate chains of all threads into avail_sb and partial lists
+    void publish_chains(SweepChains* chains);
+#ifdef SB_BITMAP
+    /*
+     * rebuild sb i, the first of its block, from checkpoint epoch like
+     * sweep_sb, and set changed if it's a small sb changed since
+     */
+    Descriptor* restore_sb(uint64_t i, uint64_t epoch, int& state,
+        bool& changed);
+#endif
 };
 
 namespace ralloc{
-    // (transient) filter functions for each root
-    extern std::function<void(const CrossPtr<char, SB_IDX>&, GarbageCollection&)> roots_filter_func[MAX_ROOTS];
+    /*
+     * Tracer registry. Each type traced by GC gets a small id on first use,
+     * mapped to a plain function that calls its filter_func. Id 0 traces
+     * conservatively, and is used for roots whose type isn't known.
+     */
+    typedef void (*TraceFunc)(char* ptr, GarbageCollection& gc);
+    const uint32_t MAX_TRACERS = 1024;
+    extern TraceFunc tracers[MAX_TRACERS];
+    // add tracer and return its id
+    uint32_t register_tracer(TraceFunc tracer);
+    template<class T>
+    inline uint32_t type_id(){
+        static const uint32_t id = register_tracer([](char* ptr, GarbageCollection& gc){
+                gc.filter_func(reinterpret_cast<T*>(ptr));
+            });
+        return id;
+    }
+    // (transient) tracer type of each root, set by get_root
+    extern uint32_t roots_type[MAX_ROOTS];
+    // GC of a lazy recovery, kept until close
+    extern std::atomic<GarbageCollection*> lazy_gc;
+}
+
+template<class T>
+inline void GarbageCollection::mark_func(T* ptr){
+    mark_typed(reinterpret_cast<char*>(ptr), ralloc::type_id<T>());
+}
+
+template<class T>
+inline void GarbageCollection::mark_field(pptr<T>& field){
+    T* ptr = field;
+    if(compacting)
+        mark_ref(reinterpret_cast<char*>(ptr), ralloc::type_id<T>(), &field, REF_PPTR);
+    else
+        mark_func(ptr);
+}
+
+template<class T>
+inline void GarbageCollection::mark_field(atomic_pptr<T>& field){
+    T* ptr = field.load(std::memory_order_relaxed);
+    if(compacting)
+        mark_ref(reinterpret_cast<char*>(ptr), ralloc::type_id<T>(), &field, REF_PPTR);
+    else
+        mark_func(ptr);
 }
 
 /*
@@ -375,9 +705,9 @@ class BaseMeta {
 public:
 
     /**
-     * xiaoxiang cache gc
+     * xiaoxiang cache gc, allocated by RP_init in each run
      */
-    GarbageCollection xiaoxiang_gc;
+    RP_TRANSIENT GarbageCollection* xiaoxiang_gc;
 
     // unused small sb
     RP_TRANSIENT AtomicCrossPtrCnt<Descriptor, DESC_IDX> avail_sb;
@@ -386,6 +716,27 @@ public:
 
     RP_PERSIST ProcHeap heaps[MAX_SZ_IDX];
     RP_PERSIST CrossPtr<char, SB_IDX> roots[MAX_ROOTS];
+    // offset in sb region from which sbs were never handed out since the
+    // heap file was created, thus still zero; NO_FRESH_SB if unknown
+    RP_PERSIST std::atomic<uint64_t> fresh_sb;
+    static constexpr uint64_t NO_FRESH_SB = UINT64_MAX;
+#ifdef SB_BITMAP
+    // current checkpoint epoch, bumped by each checkpoint
+    RP_PERSIST std::atomic<uint64_t> ckpt_epoch;
+    // epoch of the last complete checkpoint, 0 if none. It's saved in copy
+    // (epoch % 2) of the checkpoint region, and the next one in the other.
+    RP_PERSIST uint64_t ckpt_valid;
+    // recovery from checkpoint kept free blocks of changed sbs in use
+    RP_PERSIST bool ckpt_leaky;
+#endif
+    // LAYOUT of the build that created the heap; bump LAYOUT whenever a
+    // persistent member is added, moved or resized
+    RP_PERSIST uint64_t layout;
+#ifdef SB_BITMAP
+    static constexpr uint64_t LAYOUT = 0x52414C4C4F430102ULL;
+#else
+    static constexpr uint64_t LAYOUT = 0x52414C4C4F430002ULL;
+#endif
     friend class GarbageCollection;
     BaseMeta() noexcept;
     ~BaseMeta(){
@@ -395,11 +746,26 @@ public:
         std::cout<<"Warning: BaseMeta is being destructed!\n";
     }
     void* do_malloc(size_t size);
+    // do_malloc, and set fresh to whether the block is known to be zero
+    void* do_malloc(size_t size, bool& fresh);
     void do_free(void* ptr);
+    // forget fresh sbs, e.g., if the sb region was written by pre-faulting
+    void clear_fresh_sb();
+    // once it returns true, it keeps returning true until set_dirty
     bool is_dirty();
     // set_dirty must be called AFTER is_dirty
     void set_dirty();
+    // set_dirty and persist it, before a GC of a heap is_dirty found clean,
+    // so that a crash during the GC leaves the heap dirty
+    void hold_dirty();
     void set_clean();
+    /*
+     * check sbs and their descriptors on thread_num threads (0 for all
+     * available) without changing them, fill in report and return the number
+     * of inconsistencies found. Anchors, free blocks and lists are transient,
+     * so they are checked only if the heap isn't dirty.
+     */
+    uint64_t check(RP_check_report* report, int thread_num = 0);
     inline uint64_t min(uint64_t a, uint64_t b){return a>b?b:a;}
     inline uint64_t max(uint64_t a, uint64_t b){return a>b?a:b;}
     inline uint64_t round_up(uint64_t numToRound, uint64_t multiple) {
@@ -415,8 +781,8 @@ public:
             res = static_cast<void*>(roots[i]);
         roots[i] = ptr;
 
-        FLUSH(&roots[i]);
-        FLUSHFENCE;
+        pbuf_add(&roots[i], sizeof(roots[i]));
+        pbuf_commit();
         return res;
     }
     template<class T>
@@ -424,29 +790,83 @@ public:
         //this is sequential
         // assert(i<MAX_ROOTS && roots[i]!=nullptr); // we allow roots[i] to be null
         assert(i<MAX_ROOTS);
-        ralloc::roots_filter_func[i] = [](const CrossPtr<char, SB_IDX>& cptr, GarbageCollection& gc){
-            // this new statement is intentionally designed to use transient allocator since it's offline
-            gc.mark_func(static_cast<T*>(cptr));
-        };
+        ralloc::roots_type[i] = ralloc::type_id<T>();
         return static_cast<T*>(roots[i]);
     }
-    bool restart(){
+    // thread_num is the number of threads to mark with, 0 for all available
+    bool restart(int thread_num = 0){
         // Restart, setting values and flags to normal
         // Should be called during restart
+        PbufSite site(PBUF_SITE_RECOVERY);
         bool ret = is_dirty();
-        if(ret) {
-            GarbageCollection gc;
+        // also collect blocks leaked by a recovery from checkpoint
+        if(ret || ckpt_leaked()) {
+            if(!ret) hold_dirty();
+            ckpt_invalidate();
+            GarbageCollection gc(thread_num);
             gc();
         }
-        FLUSHFENCE;
+        pbuf_commit();
         // here restart is done, and "dirty" should be set to true until
         // writeback() is called so that crash will result in a true dirty.
         set_dirty();
         return ret;
     }
+    // restart, returning after marking while sweep continues in background
+    bool restart_lazy(int thread_num = 0){
+        PbufSite site(PBUF_SITE_RECOVERY);
+        bool ret = is_dirty();
+        if(ret || ckpt_leaked()) {
+            if(!ret) hold_dirty();
+            ckpt_invalidate();
+            GarbageCollection* gc = new GarbageCollection(thread_num);
+            gc->start_lazy();
+        }
+        pbuf_commit();
+        set_dirty();
+        return ret;
+    }
+    /*
+     * restart from the last checkpoint without marking: sbs unchanged since
+     * then get their saved bitmaps, and small sbs changed since then are
+     * taken as full. Falls back to restart() if there's no checkpoint.
+     */
+    bool restart_checkpoint(int thread_num = 0){
+#ifdef SB_BITMAP
+        PbufSite site(PBUF_SITE_RECOVERY);
+        bool ret = is_dirty();
+        if(ret && ckpt_valid != 0) {
+            GarbageCollection gc(thread_num);
+            gc.from_checkpoint(ckpt_valid);
+        } else if(ret) {
+            GarbageCollection gc(thread_num);
+            gc();
+        }
+        pbuf_commit();
+        set_dirty();
+        return ret;
+#else
+        return restart(thread_num);
+#endif
+    }
+    // restart with a GC that also compacts, whether dirty or not
+    bool restart_compact(int thread_num = 0){
+        PbufSite site(PBUF_SITE_RECOVERY);
+        bool ret = is_dirty();
+        // a clean heap is rewritten too, so a crash meanwhile must find it
+        // dirty
+        if(!ret) hold_dirty();
+        ckpt_invalidate();
+        GarbageCollection gc(thread_num);
+        gc.compact();
+        pbuf_commit();
+        set_dirty();
+        return ret;
+    }
     bool restart_xiaoxiang(void** pointers,int pointers_count){
         // Restart, setting values and flags to normal
         // Should be called during restart
+        PbufSite site(PBUF_SITE_RECOVERY);
         bool ret = is_dirty();
         if(ret) {
             GarbageCollection gc;
@@ -454,7 +874,7 @@ public:
             gc.pointers_count_xiaoxiang=pointers_count;
             gc();
         }
-        FLUSHFENCE;
+        pbuf_commit();
         // here restart is done, and "dirty" should be set to true until
         // writeback() is called so that crash will result in a true dirty.
         set_dirty();
@@ -462,30 +882,41 @@ public:
     }
 
     void restart_xiaoxiang_insert(void* ptr){
-        xiaoxiang_gc.mark_func(ptr);
+        // the caller inserts every live block, so they aren't traced
+        xiaoxiang_gc->insert_block(reinterpret_cast<char*>(ptr));
     }
 
     bool restart_xiaoxiang_go(){
+        PbufSite site(PBUF_SITE_RECOVERY);
         bool ret = is_dirty();
         if(ret) {
-            xiaoxiang_gc();
+            (*xiaoxiang_gc)();
         }
-        FLUSHFENCE;
+        pbuf_commit();
         set_dirty();
         return ret;
     }
 
+#ifdef SB_BITMAP
+    /*
+     * save free bitmaps of small sbs in use and return the epoch of this
+     * checkpoint, or 0 if it can't be taken now. Concurrent malloc and free
+     * are allowed: the epoch is bumped first, and any sb changed after that,
+     * or caught with blocks reserved but unclaimed, is tagged with the new
+     * epoch instead of being trusted.
+     */
+    uint64_t checkpoint();
+    // find bitmap of the sb desc describes saved by checkpoint epoch
+    std::atomic<uint64_t>* ckpt_lookup(const Descriptor* desc, uint64_t epoch);
+#endif
+
     void writeback(){
         // Give back tcached blocks *Wentao: no actually ~TCache will do this*
         // Should be called during normal exit
         // ralloc::public_flush_cache();
-        char* addr = reinterpret_cast<char*>(this);
         // flush values in BaseMeta, including avail_sb and partial lists
-        for(size_t i = 0; i < sizeof(BaseMeta); i += CACHELINE_SIZE) {
-            addr += CACHELINE_SIZE;
-            FLUSH(addr);
-        }
-        FLUSHFENCE;
+        pbuf_add(this, sizeof(BaseMeta));
+        pbuf_commit();
         set_clean();
     }
 
@@ -512,17 +943,51 @@ public:
     Descriptor* desc_lookup(const char* ptr);
     inline Descriptor* desc_lookup(const void* ptr){return desc_lookup(reinterpret_cast<const char*>(ptr));}
     char* sb_lookup(Descriptor* desc);
+#ifdef SB_BITMAP
+    // find free bitmap of the superblock desc describes
+    std::atomic<uint64_t>* bitmap_lookup(const Descriptor* desc);
+    // set all maxcount bits of bitmap as free and return number of words used
+    uint32_t bitmap_fill(std::atomic<uint64_t>* bitmap, uint32_t maxcount);
+#endif
 
 private:
     // helper func
+    // whether blocks leaked by recovery from checkpoint wait for a GC
+    inline bool ckpt_leaked(){
+#ifdef SB_BITMAP
+        return ckpt_leaky;
+#else
+        return false;
+#endif
+    }
+    // forget the last checkpoint before GC rewrites metadata
+    void ckpt_invalidate();
+#ifdef SB_BITMAP
+    // tag desc with the current epoch after it or its bitmap is changed,
+    // and before blocks it gives are used
+    void tag_epoch(Descriptor* desc);
+#endif
+    // record desc and bitmap (if any) of its sb as written since the last
+    // persist point, so that they are flushed by Regions::flush_dirty()
+    void mark_dirty(Descriptor* desc);
+    // record that [sb, sb+size) is handed out and return true if it's fresh.
+    // caller commits persist buffer before the sb is used.
+    bool claim_fresh_sb(char* sb, size_t size);
     void heap_push_partial(Descriptor* desc);
     Descriptor* heap_pop_partial(ProcHeap* heap);
+#ifdef SB_BITMAP
+    // give block_count reserved blocks back to anchor of desc, whose bits
+    // must have been set already
+    void bitmap_release(Descriptor* desc, uint32_t block_count);
+#endif
     // fill cache from a partially used sb in heap[sc_idx]
     void malloc_from_partial(size_t sc_idx, TCacheBin* cache, size_t& block_num);
     // fill cache by allocating a new sb in heap[sc_idx]
     void malloc_from_newsb(size_t sc_idx, TCacheBin* cache, size_t& block_num);
     // alloc function to call for large block
     void* alloc_large_block(size_t sz);
+    // large block allocation of do_malloc
+    void* malloc_large(size_t size, bool& fresh);
 
     // add all newly allocated sbs to free_sb
     void organize_sb_list(void* start, uint64_t count);
@@ -540,21 +1005,17 @@ private:
     Descriptor* desc_alloc();
     // put desc to avail_desc and flush it as unused
     void desc_retire(Descriptor* desc);
+    // push desc of a free sb to avail_sb
+    void push_avail_sb(Descriptor* desc);
 }__attribute__((aligned(CACHELINE_SIZE)));
 
 // default (conservative) filter function which traverse all possible pointers
 // in the block
 template<class T>
 inline void GarbageCollection::filter_func(T* ptr){
-    char* curr = reinterpret_cast<char*>(ptr);
-    Descriptor* desc = ralloc::base_md->desc_lookup((char*)ptr);
-    size_t sz = desc->block_size;
-    for(size_t i=0;i<sz;i++){
-        char* curr_content = static_cast<char*>(*(reinterpret_cast<pptr<char>*>(curr)));
-        if(curr_content!=nullptr)
-            mark_func(curr_content);
-        curr++;
-    }
+    char* blk = reinterpret_cast<char*>(ptr);
+    Descriptor* desc = ralloc::base_md->desc_lookup(blk);
+    scan_conservative(blk, desc->block_size);
 }
 
 #endif /* _BASE_META_HPP_ */
@@ -116,9 +116,8 @@ void RegionManager::__map_persistent_region() {
     curr_addr_ptr = (atomic_pptr<char> *) base_addr;
     *(uint64_t * )((size_t) base_addr + 2 * sizeof(atomic_pptr<char>)) = FILESIZE;
 
-    FLUSH(curr_addr_ptr);
-    FLUSH((uint64_t * )((size_t) base_addr + 2 * sizeof(atomic_pptr<char>)));
-    FLUSHFENCE;
+    pbuf_add(base_addr, 3 * sizeof(atomic_pptr<char>));
+    pbuf_commit();
     DBG_PRINT("Addr: %p\n", addr);
     DBG_PRINT("Base_addr: %p\n", base_addr);
     DBG_PRINT("Current_addr: %p\n", curr_addr_ptr->load());
@@ -180,9 +179,8 @@ void RegionManager::__map_transient_region() {
     curr_addr_ptr = (atomic_pptr<char> *) base_addr;
     *(uint64_t * )((size_t) base_addr + 2 * sizeof(atomic_pptr<char>)) = FILESIZE;
 
-    FLUSH(curr_addr_ptr);
-    FLUSH((uint64_t * )((size_t) base_addr + 2 * sizeof(atomic_pptr<char>)));
-    FLUSHFENCE;
+    pbuf_add(base_addr, 3 * sizeof(atomic_pptr<char>));
+    pbuf_commit();
     DBG_PRINT("Addr: %p\n", addr);
     DBG_PRINT("Base_addr: %p\n", base_addr);
     DBG_PRINT("Current_addr: %p\n", curr_addr_ptr->load());
@@ -220,9 +218,9 @@ void RegionManager::__remap_transient_region() {
 
 //persist the curr and base address
 void RegionManager::__close_persistent_region() {
-    FLUSHFENCE;
-    FLUSH(curr_addr_ptr);
-    FLUSHFENCE;
+    pbuf_commit();
+    pbuf_add(curr_addr_ptr, sizeof(atomic_pptr<char>));
+    pbuf_commit();
     DBG_PRINT("At the end current addr: %p\n", curr_addr_ptr->load());
 
     unsigned long space_used = ((unsigned long) curr_addr_ptr->load()
@@ -237,10 +235,10 @@ void RegionManager::__close_persistent_region() {
 
 //flush transient region back
 void RegionManager::__close_transient_region() {
-    FLUSHFENCE;
+    pbuf_commit();
     char *curr_addr = curr_addr_ptr->load();
-    FLUSH(curr_addr_ptr);
-    FLUSHFENCE;
+    pbuf_add(curr_addr_ptr, sizeof(atomic_pptr<char>));
+    pbuf_commit();
 
     DBG_PRINT("At the end current addr: %p\n", curr_addr);
 
@@ -257,8 +255,8 @@ void RegionManager::__close_transient_region() {
 //store heap root by offset from base
 void RegionManager::__store_heap_start(void *root) {
     *(((intptr_t *) base_addr) + 1) = (intptr_t) root - (intptr_t) base_addr;
-    FLUSH((((intptr_t *) base_addr) + 1));
-    FLUSHFENCE;
+    pbuf_add((((intptr_t *) base_addr) + 1), sizeof(intptr_t));
+    pbuf_commit();
 }
 
 //retrieve heap root
@@ -289,11 +287,11 @@ int RegionManager::__nvm_region_allocator(void **memptr, size_t alignment, size_
         return -1;
     }
     new_curr_addr = next;
-    FLUSH(curr_addr_ptr);
-    FLUSHFENCE;
+    pbuf_add(curr_addr_ptr, sizeof(atomic_pptr<char>));
+    pbuf_commit();
     if (curr_addr_ptr->compare_exchange_strong(old_curr_addr, new_curr_addr)) {
-        FLUSH(curr_addr_ptr);
-        FLUSHFENCE;
+        pbuf_add(curr_addr_ptr, sizeof(atomic_pptr<char>));
+        pbuf_commit();
         *memptr = res;
         return 1;
     }
@@ -324,11 +322,11 @@ int RegionManager::__try_nvm_region_allocator(void **memptr, size_t alignment, s
         return -1;
     }
     new_curr_addr = next;
-    FLUSH(curr_addr_ptr);
-    FLUSHFENCE;
+    pbuf_add(curr_addr_ptr, sizeof(atomic_pptr<char>));
+    pbuf_commit();
     if (curr_addr_ptr->compare_exchange_strong(old_curr_addr, new_curr_addr)) {
-        FLUSH(curr_addr_ptr);
-        FLUSHFENCE;
+        pbuf_add(curr_addr_ptr, sizeof(atomic_pptr<char>));
+        pbuf_commit();
         *memptr = res;
         return 0;
     } else {
@@ -349,3 +347,45 @@ void RegionManager::__destroy() {
     remove(HEAPFILE.c_str());
     return;
 }
+
+void Regions::track_dirty(int index, size_t chunk) {
+    assert(dirty[index] == nullptr);
+    // nothing to write back later, so mark_dirty() becomes a null check
+    if (!pwb_needs_writeback()) return;
+    assert((chunk & (chunk - 1)) == 0); // should be power of 2
+    int shift = 0;
+    while (((size_t) 1 << shift) < chunk) shift++;
+    size_t chunk_num = (regions[index]->FILESIZE + chunk - 1) >> shift;
+    dirty_words[index] = (chunk_num + 63) / 64;
+    dirty_shift[index] = shift;
+    dirty[index] = new std::atomic<uint64_t>[dirty_words[index]]();
+}
+
+void Regions::flush_dirty(int index) {
+    if (!pwb_needs_writeback()) return;
+    std::atomic<uint64_t> *bits = dirty[index];
+    if (bits == nullptr) {
+        flush_region(index);
+        return;
+    }
+    char *base = regions_address[index];
+    if (base == nullptr) return; // nothing allocated in the region yet
+    int shift = dirty_shift[index];
+    size_t used = regions[index]->curr_addr_ptr->load() - base;
+    size_t words = (((used + ((size_t) 1 << shift) - 1) >> shift) + 63) / 64;
+    if (words > dirty_words[index]) words = dirty_words[index];
+    // serial, as it runs from a static destructor, after which the OpenMP
+    // runtime may already be shut down
+    for (size_t w = 0; w < words; w++) {
+        if (bits[w].load(std::memory_order_relaxed) == 0) continue;
+        uint64_t word = bits[w].exchange(0);
+        while (word != 0) {
+            int first = __builtin_ctzll(word);
+            uint64_t rest = ~(word >> first);
+            int len = rest != 0 ? __builtin_ctzll(rest) : 64 - first;
+            pbuf_add(base + ((w * 64 + first) << shift), (size_t) len << shift);
+            word = first + len == 64 ? 0 : word & ~(((1ULL << len) - 1) << first);
+        }
+    }
+    pbuf_commit();
+}
@@ -165,11 +165,22 @@ public:
     RegionManager* regions[LAST_IDX];
     char* regions_address[LAST_IDX]; // base address of each region
     int cur_idx;
+    /*
+     * Transient (DRAM) bitmaps of each region recording which chunks were
+     * written since the last persist point, one bit per (1<<dirty_shift)
+     * bytes. nullptr if the region isn't tracked.
+     */
+    std::atomic<uint64_t>* dirty[LAST_IDX];
+    size_t dirty_words[LAST_IDX];
+    int dirty_shift[LAST_IDX];
     Regions(){
         cur_idx=0;
         for(int i=0;i<LAST_IDX; i++){
             regions[i]=nullptr;
             regions_address[i]=nullptr;
+            dirty[i]=nullptr;
+            dirty_words[i]=0;
+            dirty_shift[i]=0;
         }
     }
     ~Regions(){
@@ -178,6 +189,10 @@ public:
             regions[i]=nullptr;
             regions_address[i]=nullptr;
         }
+        for(int i=0;i<LAST_IDX; i++){
+            delete[] dirty[i];
+            dirty[i]=nullptr;
+        }
         cur_idx = 0;
     }
 
@@ -273,11 +288,33 @@ public:
         RegionManager* target = regions[index];
         char* addr = regions_address[index];
         char* ending = target->curr_addr_ptr->load();
-        for(; addr < ending; addr += CACHELINE_SIZE) {
-            FLUSH(addr);
+        pbuf_add(addr, ending - addr);
+        pbuf_commit();
+    }
+
+    /* track writes to region $index$ at granularity of $chunk$ (power of 2) bytes */
+    void track_dirty(int index, size_t chunk);
+
+    /* record that [addr, addr+len) of region $index$ is written */
+    inline void mark_dirty(int index, const void* addr, size_t len = 1){
+        std::atomic<uint64_t>* bits = dirty[index];
+        if(bits == nullptr) return;
+        size_t offset = (const char*)addr - regions_address[index];
+        size_t first = offset >> dirty_shift[index];
+        size_t last = (offset + len - 1) >> dirty_shift[index];
+        for(size_t i = first; i <= last; i++) {
+            uint64_t mask = 1ULL << (i % 64);
+            // avoid contended RMW on chunks already marked
+            if(!(bits[i / 64].load(std::memory_order_relaxed) & mask))
+                bits[i / 64].fetch_or(mask, std::memory_order_relaxed);
         }
-        FLUSHFENCE;
     }
+
+    /*
+     * writeback chunks of region $index$ written since the last call. Falls back to flush_region() if the region isn't
+     * tracked.
+     */
+    void flush_dirty(int index);
 };
 
 #endif /* _REGION_MANAGER_HPP_ */
\ No newline at end of file
@@ -30,32 +30,13 @@ uint64_t readTSC(int front, int back) {
 
 void TCacheBin::push_block(char* block)
 {
-    uint64_t a,b,c;
-
-    a= readTSC(1,1);
-
 	// block has at least sizeof(char*)
-//	*(pptr<char>*)block = _block;
-//    *((char**)block)=_block;
-    char* ptr = _block;
-    *(pptr<char>*)ptr= _block;
-//    pmem_memcpy_persist(block,&ptr,sizeof(char*));
-    memcpy(block,&ptr,sizeof(char*));
-//    *(char**)block=ptr;
-
-    b= readTSC(1,1);
-
+	if (get_list_num() == 0)
+		*(pptr<char>*)block = nullptr;
+	else
+		*(pptr<char>*)block = _block;
 	_block = block;
 	_block_num++;
-
-    c= readTSC(1,1);
-
-    static int times=0;
-
-    if (times++%1000==0){
-        times=0;
-//        printf("tc a-b %lu b-c %lu\n",b-a,c-b);
-    }
 }
 
 void TCacheBin::push_list(char* block, uint32_t length)
@@ -66,29 +47,100 @@ void TCacheBin::push_list(char* block, uint32_t length)
 
 	_block = block;
 	_block_num = length;
+	_carve_num = 0;
+	_superblock = nullptr;
 }
 
-char* TCacheBin::pop_block()
+#ifdef SB_BITMAP
+void TCacheBin::push_bitmap(char* superblock, std::atomic<uint64_t>* bitmap,
+	uint32_t block_size, uint32_t maxcount, uint32_t length)
+{
+	assert(_block_num == 0);
+
+	_block = nullptr;
+	_block_num = length;
+	_carve_num = length;
+	_superblock = superblock;
+	_bitmap = bitmap;
+	_block_size = block_size;
+	_maxcount = maxcount;
+	_carve_word = 0;
+}
+
+char* TCacheBin::carve_block()
+{
+	// we own _carve_num blocks of the superblock and the bitmap has at least
+	// that many free bits, though some of them may be taken by other threads
+	// who also own blocks of it. Wrap around until we claim one.
+	uint32_t const word_num = (_maxcount + 63) / 64;
+	while (true) {
+		std::atomic<uint64_t>& word = _bitmap[_carve_word];
+		uint64_t bits = word.load(std::memory_order_relaxed);
+		while (bits != 0) {
+			uint64_t bit = __builtin_ctzll(bits);
+			if (word.compare_exchange_weak(bits, bits & ~(1ULL << bit))) {
+				_carve_num--;
+				return _superblock + (_carve_word * 64 + bit) * _block_size;
+			}
+		}
+		if (++_carve_word == word_num)
+			_carve_word = 0;
+	}
+}
+#else
+void TCacheBin::push_superblock(char* superblock, uint32_t block_size,
+	uint32_t maxcount, bool fresh)
 {
-    // caller must ensure there's an available block
-    assert(_block_num > 0);
+	assert(_block_num == 0);
 
-    char* ret = _block;
+	_block = nullptr;
+	_block_num = maxcount;
+	_carve_num = maxcount;
+	_superblock = superblock;
+	_block_size = block_size;
+	_maxcount = maxcount;
+	_block_idx = 0;
+	_carve_fresh = fresh;
+}
 
-    if ((char*)(*(pptr<char>*)ret)==NULL && _block_idx<_maxcount-1){
-        *(pptr<char>*)ret = _superblock + (_block_idx++ + 1) * _block_size;
-    }
+char* TCacheBin::carve_block()
+{
+	_carve_num--;
+	return _superblock + (_block_idx++) * _block_size;
+}
+#endif
 
-    char* next = (char*)(*(pptr<char>*)ret);
+char* TCacheBin::pop_block()
+{
+	// caller must ensure there's an available block
+	assert(_block_num > 0);
+
+	char* ret;
+	if (get_list_num() == 0) {
+		// the list runs out, so carve one from the superblock
+		ret = carve_block();
+	} else {
+		ret = _block;
+		_block = (char*)(*(pptr<char>*)ret);
+	}
+	_block_num--;
+	return ret;
+}
 
-    _block = next;
-    _block_num--;
-    return ret;
+char* TCacheBin::pop_block(bool& fresh)
+{
+#ifdef SB_BITMAP
+	// claimed bits may belong to blocks freed by others
+	fresh = false;
+#else
+	fresh = get_list_num() == 0 && _carve_fresh;
+#endif
+	return pop_block();
 }
 
 void TCacheBin::pop_list(char* block, uint32_t length)
 {
-	assert(_block_num >= length);
+	assert(get_list_num() >= length);
 
 	_block = block;
 	_block_num -= length;
@@ -14,6 +14,8 @@
 #ifndef __TCACHE_H_
 #define __TCACHE_H_
 
+#include <atomic>
+
 #include "pm_config.hpp"
 #include "pfence_util.h"
 #include "SizeClass.hpp"
@@ -44,26 +46,64 @@ public:
 	char* _block;//absolute address of block
 	uint32_t _block_num;
 
+	/* 
+	 * Blocks of the superblock this cache was last filled from are carved
+	 * lazily: the first (_block_num - _carve_num) blocks are in the list
+	 * headed by _block, and the rest _carve_num blocks are handed out from
+	 * _superblock only when the list runs out.
+	 *
+	 * Without SB_BITMAP, carved blocks are taken in order from _block_idx.
+	 * With SB_BITMAP, _carve_num is the number of blocks reserved from the
+	 * anchor of the superblock, which are claimed one by one from the free
+	 * bits in _bitmap starting at word _carve_word.
+	 *
+	 * Without SB_BITMAP, _carve_fresh tells that the superblock was never
+	 * used since the heap file was created, so carved blocks are all zero.
+	 */
+	uint32_t _carve_num;
     uint32_t _block_idx;
     uint32_t _block_size;
     uint32_t _maxcount;
     char* _superblock;
+#ifdef SB_BITMAP
+    std::atomic<uint64_t>* _bitmap;
+    uint32_t _carve_word;
+#else
+    bool _carve_fresh;
+#endif
 
 public:
 	// common, fast ops
 	void push_block(char* block);
 	// push block list, cache *must* be empty
 	void push_list(char* block, uint32_t length);
+#ifdef SB_BITMAP
+	// reserve length free blocks of superblock to be claimed from bitmap,
+	// cache *must* be empty
+	void push_bitmap(char* superblock, std::atomic<uint64_t>* bitmap,
+		uint32_t block_size, uint32_t maxcount, uint32_t length);
+#else
+	// carve all blocks of a new superblock, cache *must* be empty
+	void push_superblock(char* superblock, uint32_t block_size, 
+		uint32_t maxcount, bool fresh);
+#endif
 
 	char* pop_block(); // can return nullptr
+	// pop_block, and set fresh to whether the block is known to be zero
+	char* pop_block(bool& fresh);
 	// manually popped list of blocks and now need to update cache
 	// `block` is the new head
 	void pop_list(char* block, uint32_t length);
 	char* peek_block() const { return _block; }
 
 	uint32_t get_block_num() const { return _block_num; }
-	TCacheBin() noexcept:_block(nullptr), _block_num(0) {};
+	// number of blocks in the list, excluding blocks to be carved
+	uint32_t get_list_num() const { return _block_num - _carve_num; }
+	TCacheBin() noexcept:_block(nullptr), _block_num(0), _carve_num(0),
+		_superblock(nullptr) {};
 	// slow operations like fill/flush handled in cache user
+private:
+	char* carve_block();
 };
 
 namespace ralloc{
@@ -75,6 +115,7 @@ struct TCaches
 	TCaches():t_cache(){};
 	~TCaches(){
 		ralloc::public_flush_cache();
+		pbuf_accumulate();
 	}
 };
 
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details. 
+ */
+
+#include <atomic>
+#include <cstring>
+#include <emmintrin.h>
+
+#include "pfence_util.h"
+
+/*
+ * pfence_util.cpp contains the thread-local state of persist buffers declared
+ * in pfence_util.h, the totals of their counters, and bulk persistence.
+ */
+
+__thread struct pbuf _pbuf;
+
+static std::atomic<uint64_t> total_added_lines[PBUF_SITE_NUM];
+static std::atomic<uint64_t> total_flushed_lines[PBUF_SITE_NUM];
+static std::atomic<uint64_t> total_commits[PBUF_SITE_NUM];
+
+void pbuf_accumulate(void) {
+    for (int i = 0; i < PBUF_SITE_NUM; i++) {
+        total_added_lines[i].fetch_add(_pbuf.added_lines[i]);
+        total_flushed_lines[i].fetch_add(_pbuf.flushed_lines[i]);
+        total_commits[i].fetch_add(_pbuf.commits[i]);
+        _pbuf.added_lines[i] = 0;
+        _pbuf.flushed_lines[i] = 0;
+        _pbuf.commits[i] = 0;
+    }
+}
+
+void pbuf_get_stats(struct pbuf_stats* stats) {
+    for (int i = 0; i < PBUF_SITE_NUM; i++) {
+        stats->added_lines[i] = total_added_lines[i].load() + _pbuf.added_lines[i];
+        stats->flushed_lines[i] = total_flushed_lines[i].load() + _pbuf.flushed_lines[i];
+        stats->commits[i] = total_commits[i].load() + _pbuf.commits[i];
+    }
+}
+
+void pbuf_get_local_stats(struct pbuf_stats* stats) {
+    for (int i = 0; i < PBUF_SITE_NUM; i++) {
+        stats->added_lines[i] = _pbuf.added_lines[i];
+        stats->flushed_lines[i] = _pbuf.flushed_lines[i];
+        stats->commits[i] = _pbuf.commits[i];
+    }
+}
+
+const char* pbuf_site_name(int site) {
+    static const char* names[PBUF_SITE_NUM] = {
+        "other", "malloc", "free", "fill_cache", "flush_cache", "recovery",
+        "checkpoint"
+    };
+    if (site < 0 || site >= PBUF_SITE_NUM) return "unknown";
+    return names[site];
+}
+
+/*
+ * Bulk persistence. Ranges of at least PWB_NT_THRESHOLD bytes are written
+ * with non-temporal stores for whole cache lines, which bypass the cache and
+ * need no writeback; only the unaligned head and tail go through the persist
+ * buffer. NT stores are only used when there is real writeback (not under
+ * noop, latency emulation or a policy without writeback), as they would be
+ * slower than cached stores on DRAM.
+ */
+static inline bool pwb_nt_enabled(void) {
+    if (!pwb_needs_writeback()) return false;
+#if defined(PWB_IS_RUNTIME)
+    return _pwb_kind == PWB_KIND_CLWB || _pwb_kind == PWB_KIND_CLFLUSHOPT ||
+        _pwb_kind == PWB_KIND_CLFLUSH;
+#elif defined(PWB_IS_CLWB) || defined(PWB_IS_CLFLUSHOPT) || defined(PWB_IS_CLFLUSH)
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* commit persist buffer and order NT stores with a single sfence */
+static inline void pwb_nt_commit(void) {
+    pbuf_drain();
+    _mm_sfence();
+    _pbuf.commits[_pbuf.site]++;
+}
+
+void pwb_memcpy_persist(void* dst, const void* src, size_t len) {
+    if (len < PWB_NT_THRESHOLD || !pwb_nt_enabled()) {
+        memcpy(dst, src, len);
+        pbuf_add(dst, len);
+        pbuf_commit();
+        return;
+    }
+    char* d = (char*)dst;
+    const char* s = (const char*)src;
+    size_t head = (PBUF_LINE_SIZE - ((uintptr_t)d & (PBUF_LINE_SIZE - 1))) &
+        (PBUF_LINE_SIZE - 1);
+    memcpy(d, s, head);
+    pbuf_add(d, head);
+    d += head;
+    s += head;
+    len -= head;
+    for (; len >= PBUF_LINE_SIZE; len -= PBUF_LINE_SIZE) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)s);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_stream_si128((__m128i*)d, v0);
+        _mm_stream_si128((__m128i*)(d + 16), v1);
+        _mm_stream_si128((__m128i*)(d + 32), v2);
+        _mm_stream_si128((__m128i*)(d + 48), v3);
+        d += PBUF_LINE_SIZE;
+        s += PBUF_LINE_SIZE;
+    }
+    memcpy(d, s, len);
+    pbuf_add(d, len);
+    pwb_nt_commit();
+}
+
+void pwb_memset_persist(void* dst, int c, size_t len) {
+    if (len < PWB_NT_THRESHOLD || !pwb_nt_enabled()) {
+        memset(dst, c, len);
+        pbuf_add(dst, len);
+        pbuf_commit();
+        return;
+    }
+    char* d = (char*)dst;
+    size_t head = (PBUF_LINE_SIZE - ((uintptr_t)d & (PBUF_LINE_SIZE - 1))) &
+        (PBUF_LINE_SIZE - 1);
+    memset(d, c, head);
+    pbuf_add(d, head);
+    d += head;
+    len -= head;
+    __m128i v = _mm_set1_epi8((char)c);
+    for (; len >= PBUF_LINE_SIZE; len -= PBUF_LINE_SIZE) {
+        _mm_stream_si128((__m128i*)d, v);
+        _mm_stream_si128((__m128i*)(d + 16), v);
+        _mm_stream_si128((__m128i*)(d + 32), v);
+        _mm_stream_si128((__m128i*)(d + 48), v);
+        d += PBUF_LINE_SIZE;
+    }
+    memset(d, c, len);
+    pbuf_add(d, len);
+    pwb_nt_commit();
+}
@@ -7,52 +7,53 @@
 #ifndef PFENCE_UTIL_H
 #define PFENCE_UTIL_H
 
+#include <cpuid.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /*
- * This file contains 3 versions of flush and fence macros:
+ * This file contains the following versions of flush and fence macros:
  * 1. PWB_IS_CLFLUSH
  *    This uses clflush as flush, and noop as fence since (sequential) clflush
  *    doesn't need explicit fence to order.
- * 2. PWB_IS_CLWB
+ * 2. PWB_IS_CLFLUSHOPT
+ *    This uses clflushopt as flush and sfence as fence.
+ * 3. PWB_IS_CLWB
  *    This uses clwb as flush and sfence as fence.
- * 3. PWB_IS_PCM
+ * 4. PWB_IS_NOOP
+ *    This does no writeback at all, e.g., for DRAM or platforms with eADR.
+ * 5. PWB_IS_PCM
  *    This only emulates the latency of persistent memory and has no effect on
- *    writeback behavior.
- * 
- * To be compatible on machines with no clwb (which usually aren't equipped by
- * real persistent memory), we use macro SHM_SIMULATING to switch between
- * clflush and clwb.
+ *    writeback behavior. Latencies are fixed to 340ns and 500ns; prefer
+ *    RALLOC_PWB=emulate below, which makes them configurable.
+ * 6. PWB_IS_RUNTIME
+ *    This is the default when none of the above is defined. The flush
+ *    instruction is picked at runtime by pwb_init() among clwb, clflushopt,
+ *    clflush and noop, so that the same binary runs on any x86-64 host.
+ *    pwb_init() is called by RP_init(). It picks the best instruction
+ *    supported by the CPU, unless environment variable RALLOC_PWB is set to
+ *    one of "clwb", "clflushopt", "clflush" or "noop". Since eADR can't be
+ *    detected from CPUID, noop is only selected through RALLOC_PWB, and it
+ *    also selects PWB_DOMAIN_EADR, see pwb_policy_init().
+ *    Before pwb_init(), clflush is used as it's available everywhere.
+ *    RALLOC_PWB=emulate emulates NVM on DRAM like PWB_IS_PCM, but with TSC
+ *    frequency calibrated at pwb_init() and latencies and bandwidth taken
+ *    from the environment; see pwb_emulation_init().
  */
 
 // Uncomment to enable durable linearizability
 #define DUR_LIN
 
-#ifdef SHM_SIMULATING
-  #define PWB_IS_CLFLUSH
-#else
-  #define PWB_IS_CLWB
-#endif
+// size of a cache line to write back
+#define PBUF_LINE_SIZE 64
 
-#ifdef DUR_LIN
-  #ifdef PWB_IS_NOOP
-    #define FLUSH(addr)
-    #define FLUSHFENCE 
-  #elif defined(PWB_IS_CLFLUSH)
-    #define FLUSH(addr) asm volatile ("clflush (%0)" :: "r"(addr))
-    #define FLUSHFENCE 
-  #elif defined(PWB_IS_CLWB)
-    #define FLUSH(addr) asm volatile ("clwb (%0)" :: "r"(addr))
-    #define FLUSHFENCE asm volatile ("sfence" ::: "memory")
-  #elif defined(PWB_IS_PCM)
-    #define FLUSH(addr) emulate_latency_ns(340)
-    #define FLUSHFENCE emulate_latency_ns(500)
-  #else
-    #error "Please define what PWB is."
-  #endif /* PWB_IS_? */
-#else /* !DUR_LIN */
-    #define FLUSH(addr) 
-    #define FLUSHFENCE 
+#if !defined(PWB_IS_CLFLUSH) && !defined(PWB_IS_CLFLUSHOPT) && \
+    !defined(PWB_IS_CLWB) && !defined(PWB_IS_NOOP) && !defined(PWB_IS_PCM)
+  #define PWB_IS_RUNTIME
 #endif
 
 /*
@@ -68,9 +69,30 @@ static inline unsigned long long asm_rdtsc(void)
 }
 
 // Change this depending on the clock cycle of your cpu. For Cervino it's 2100, for my laptop it's 2712.
+// Only used until pwb_calibrate_tsc() measures the real one.
 #define EMULATED_CPUFREQ  2300
 
-#define NS2CYCLE(__ns) ((__ns) * EMULATED_CPUFREQ / 1000)
+/*
+ * Parameters of NVM latency emulation. cycles_per_us is TSC cycles per
+ * microsecond. wb_cycles and fence_cycles are the emulated latency of a
+ * writeback and a fence. line_cycles is the time to write back a line at the
+ * emulated bandwidth, 0 for unlimited, and bw_next is the TSC at which the
+ * emulated device becomes free. Defined as weak for the same reason as
+ * _pwb_kind below.
+ */
+struct pwb_emulation {
+    uint64_t cycles_per_us;
+    uint64_t wb_cycles;
+    uint64_t fence_cycles;
+    uint64_t line_cycles;
+    uint64_t bw_next;
+};
+
+__attribute__((weak)) struct pwb_emulation _pwb_emu = {
+    EMULATED_CPUFREQ, 340 * EMULATED_CPUFREQ / 1000,
+    500 * EMULATED_CPUFREQ / 1000, 0, 0};
+
+#define NS2CYCLE(__ns) ((__ns) * _pwb_emu.cycles_per_us / 1000)
 
 static inline void emulate_latency_ns(int ns) {
     uint64_t stop;
@@ -87,4 +109,422 @@ static inline void emulate_latency_ns(int ns) {
     } while (stop - start < cycles);
 }
 
+/*
+ * Measure TSC frequency against CLOCK_MONOTONIC over ~10ms, store it to
+ * _pwb_emu.cycles_per_us and return it.
+ */
+static inline uint64_t pwb_calibrate_tsc(void) {
+    struct timespec t0, t1;
+    uint64_t c0, c1, ns;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = asm_rdtsc();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    } while (ns < 10000000ULL);
+    c1 = asm_rdtsc();
+    _pwb_emu.cycles_per_us = (c1 - c0) * 1000 / ns;
+    if (_pwb_emu.cycles_per_us == 0) _pwb_emu.cycles_per_us = 1;
+    return _pwb_emu.cycles_per_us;
+}
+
+static inline uint64_t pwb_env_u64(const char* name, uint64_t dflt) {
+    const char* env = getenv(name);
+    if (env == NULL || *env == '\0') return dflt;
+    return strtoull(env, NULL, 10);
+}
+
+/*
+ * Set up latency emulation: calibrate TSC and read latencies (ns) and
+ * bandwidth (MB/s) from RALLOC_EMU_WB_NS, RALLOC_EMU_FENCE_NS and
+ * RALLOC_EMU_BW_MBPS. Latencies default to 340ns and 500ns, and bandwidth
+ * defaults to 0 (unlimited).
+ */
+static inline void pwb_emulation_init(void) {
+    uint64_t bw = pwb_env_u64("RALLOC_EMU_BW_MBPS", 0);
+    pwb_calibrate_tsc();
+    _pwb_emu.wb_cycles = NS2CYCLE(pwb_env_u64("RALLOC_EMU_WB_NS", 340));
+    _pwb_emu.fence_cycles = NS2CYCLE(pwb_env_u64("RALLOC_EMU_FENCE_NS", 500));
+    // 1 MB/s is 1 byte/us
+    _pwb_emu.line_cycles = bw == 0 ? 0 :
+        PBUF_LINE_SIZE * _pwb_emu.cycles_per_us / bw;
+    _pwb_emu.bw_next = 0;
+}
+
+static inline void pwb_emulate_wait(uint64_t until) {
+    while (asm_rdtsc() < until);
+}
+
+/*
+ * Emulate a writeback: it takes wb_cycles, and under a bandwidth limit it
+ * also waits for its turn on the emulated device shared by all threads.
+ */
+static inline void pwb_emulate_wb(void) {
+    uint64_t start = asm_rdtsc();
+    uint64_t until = start + _pwb_emu.wb_cycles;
+    if (_pwb_emu.line_cycles != 0) {
+        uint64_t next = __atomic_load_n(&_pwb_emu.bw_next, __ATOMIC_RELAXED);
+        uint64_t slot;
+        do {
+            slot = next > start ? next : start;
+        } while (!__atomic_compare_exchange_n(&_pwb_emu.bw_next, &next,
+            slot + _pwb_emu.line_cycles, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (slot + _pwb_emu.line_cycles > until) {
+            until = slot + _pwb_emu.line_cycles;
+        }
+    }
+    pwb_emulate_wait(until);
+}
+
+enum pwb_kind {
+    PWB_KIND_NOOP = 0,
+    PWB_KIND_CLFLUSH,
+    PWB_KIND_CLFLUSHOPT,
+    PWB_KIND_CLWB,
+    PWB_KIND_EMULATE,
+    PWB_KIND_NUM
+};
+
+/*
+ * Flush instruction in use. Defined as weak in the header so that programs
+ * using FLUSH without linking Ralloc (e.g., benchmarks of other allocators)
+ * still get one copy.
+ */
+__attribute__((weak)) int _pwb_kind = PWB_KIND_CLFLUSH;
+
+static inline void pwb_flush(const void* addr) {
+    switch (_pwb_kind) {
+    case PWB_KIND_CLWB:
+        asm volatile ("clwb (%0)" :: "r"(addr));
+        break;
+    case PWB_KIND_CLFLUSHOPT:
+        asm volatile ("clflushopt (%0)" :: "r"(addr));
+        break;
+    case PWB_KIND_CLFLUSH:
+        asm volatile ("clflush (%0)" :: "r"(addr));
+        break;
+    case PWB_KIND_EMULATE:
+        pwb_emulate_wb();
+        break;
+    default:
+        break;
+    }
+}
+
+static inline void pwb_fence(void) {
+    if (_pwb_kind == PWB_KIND_CLWB || _pwb_kind == PWB_KIND_CLFLUSHOPT) {
+        asm volatile ("sfence" ::: "memory");
+    } else if (_pwb_kind == PWB_KIND_EMULATE) {
+        asm volatile ("" ::: "memory");
+        pwb_emulate_wait(asm_rdtsc() + _pwb_emu.fence_cycles);
+    } else {
+        asm volatile ("" ::: "memory");
+    }
+}
+
+static inline const char* pwb_name(int kind) {
+    switch (kind) {
+    case PWB_KIND_CLWB: return "clwb";
+    case PWB_KIND_CLFLUSHOPT: return "clflushopt";
+    case PWB_KIND_CLFLUSH: return "clflush";
+    case PWB_KIND_EMULATE: return "emulate";
+    default: return "noop";
+    }
+}
+
+/*
+ * Pick the flush instruction from CPUID and RALLOC_PWB, and return the kind
+ * picked. An override the CPU doesn't support is ignored with a warning.
+ */
+static inline int pwb_init(void) {
+    unsigned eax, ebx, ecx, edx;
+    int supported[PWB_KIND_NUM] = {1, 0, 0, 0, 1};
+    int kind = PWB_KIND_NOOP;
+    int i;
+    const char* env = getenv("RALLOC_PWB");
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        supported[PWB_KIND_CLFLUSH] = (edx >> 19) & 1;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        supported[PWB_KIND_CLFLUSHOPT] = (ebx >> 23) & 1;
+        supported[PWB_KIND_CLWB] = (ebx >> 24) & 1;
+    }
+    for (i = PWB_KIND_CLWB; i > PWB_KIND_NOOP; i--) {
+        if (supported[i]) {
+            kind = i;
+            break;
+        }
+    }
+    if (env != NULL && *env != '\0') {
+        for (i = PWB_KIND_NOOP; i < PWB_KIND_NUM; i++) {
+            if (strcmp(env, pwb_name(i)) == 0) break;
+        }
+        if (i == PWB_KIND_NUM) {
+            fprintf(stderr, "RALLOC_PWB=%s is unknown, using %s\n",
+                env, pwb_name(kind));
+        } else if (!supported[i]) {
+            fprintf(stderr, "RALLOC_PWB=%s isn't supported by CPU, using %s\n",
+                env, pwb_name(kind));
+        } else {
+            kind = i;
+        }
+    }
+    if (kind == PWB_KIND_EMULATE) {
+        pwb_emulation_init();
+    }
+    _pwb_kind = kind;
+    return kind;
+}
+
+/*
+ * Persistence policy
+ *
+ * Persistence domain of the heap, which decides whether writebacks and fences
+ * are needed at all. Under PWB_DOMAIN_ADR (the default) caches are volatile
+ * and written lines must be flushed and fenced. Under PWB_DOMAIN_EADR caches
+ * are flushed by the platform on power failure, and under PWB_DOMAIN_VOLATILE
+ * the heap is in DRAM and only has to survive a process crash; in both, data
+ * is durable once it is stored, so the persist buffer, dirty tracking and bulk
+ * NT stores are all skipped. Recovery doesn't depend on the policy: roots, the
+ * dirty flag and GC work the same way in every domain.
+ *
+ * The domain is taken from environment variable RALLOC_PERSIST_DOMAIN ("adr",
+ * "eadr" or "volatile") by pwb_policy_init(), called by RP_init(). It must not
+ * change while a heap is open. RALLOC_PWB=noop is an alias for "eadr", and so
+ * is building with PWB_IS_NOOP, which also makes writeback constant false so
+ * that the compiler removes all persistence work. Defined as weak for the
+ * same reason as _pwb_kind.
+ */
+enum pwb_domain {
+    PWB_DOMAIN_ADR = 0,
+    PWB_DOMAIN_EADR,
+    PWB_DOMAIN_VOLATILE,
+    PWB_DOMAIN_NUM
+};
+
+struct pwb_policy {
+    int domain;
+    int writeback; // nonzero if stores must be written back and fenced
+};
+
+__attribute__((weak)) struct pwb_policy _pwb_policy = {PWB_DOMAIN_ADR, 1};
+
+static inline int pwb_needs_writeback(void) {
+#if defined(PWB_IS_NOOP) || !defined(DUR_LIN)
+    return 0;
+#else
+    return __builtin_expect(_pwb_policy.writeback, 1);
+#endif
+}
+
+static inline const char* pwb_domain_name(int domain) {
+    switch (domain) {
+    case PWB_DOMAIN_EADR: return "eadr";
+    case PWB_DOMAIN_VOLATILE: return "volatile";
+    default: return "adr";
+    }
+}
+
+/*
+ * set the policy from RALLOC_PERSIST_DOMAIN, or eADR for a noop flush, and
+ * return the domain
+ */
+static inline int pwb_policy_init(void) {
+    int domain = PWB_DOMAIN_ADR;
+    int i;
+    const char* env = getenv("RALLOC_PWB");
+#ifdef PWB_IS_NOOP
+    int noop = 1;
+#else
+    int noop = env != NULL && strcmp(env, "noop") == 0;
+#endif
+    if (noop) {
+        domain = PWB_DOMAIN_EADR;
+    }
+    env = getenv("RALLOC_PERSIST_DOMAIN");
+    if (env != NULL && *env != '\0') {
+        for (i = PWB_DOMAIN_ADR; i < PWB_DOMAIN_NUM; i++) {
+            if (strcmp(env, pwb_domain_name(i)) == 0) break;
+        }
+        if (i == PWB_DOMAIN_NUM) {
+            fprintf(stderr, "RALLOC_PERSIST_DOMAIN=%s is unknown, using %s\n",
+                env, pwb_domain_name(domain));
+        } else if (noop && i == PWB_DOMAIN_ADR) {
+            // nothing would be written back
+            fprintf(stderr, "RALLOC_PERSIST_DOMAIN=adr needs writebacks, "
+                "using %s for a noop flush\n", pwb_domain_name(domain));
+        } else {
+            domain = i;
+        }
+    }
+    _pwb_policy.domain = domain;
+    _pwb_policy.writeback = domain == PWB_DOMAIN_ADR;
+    return domain;
+}
+
+#ifdef DUR_LIN
+  #ifdef PWB_IS_NOOP
+    #define FLUSH(addr)
+    #define FLUSHFENCE 
+  #elif defined(PWB_IS_CLFLUSH)
+    #define FLUSH(addr) asm volatile ("clflush (%0)" :: "r"(addr))
+    #define FLUSHFENCE 
+  #elif defined(PWB_IS_CLFLUSHOPT)
+    #define FLUSH(addr) asm volatile ("clflushopt (%0)" :: "r"(addr))
+    #define FLUSHFENCE asm volatile ("sfence" ::: "memory")
+  #elif defined(PWB_IS_CLWB)
+    #define FLUSH(addr) asm volatile ("clwb (%0)" :: "r"(addr))
+    #define FLUSHFENCE asm volatile ("sfence" ::: "memory")
+  #elif defined(PWB_IS_PCM)
+    #define FLUSH(addr) emulate_latency_ns(340)
+    #define FLUSHFENCE emulate_latency_ns(500)
+  #elif defined(PWB_IS_RUNTIME)
+    #define FLUSH(addr) pwb_flush((const void*)(addr))
+    #define FLUSHFENCE pwb_fence()
+  #else
+    #error "Please define what PWB is."
+  #endif /* PWB_IS_? */
+#else /* !DUR_LIN */
+    #define FLUSH(addr) 
+    #define FLUSHFENCE 
+#endif
+
+/*
+ * Persist buffer
+ *
+ * A per-thread buffer to combine writebacks. pbuf_add(addr, len) records
+ * cache lines covering [addr, addr+len), skipping lines already recorded
+ * since the last commit. pbuf_commit() writes back each recorded line once
+ * and then issues a single fence.
+ *
+ * When the buffer is full, recorded lines are written back early without a
+ * fence, which is still ordered by the fence of the next pbuf_commit(). Ranges
+ * longer than the buffer are written back directly for the same reason.
+ *
+ * Counters in struct pbuf show the saving: lines recorded by pbuf_add() vs.
+ * lines actually written back (flushes), and number of commits (fences).
+ * They are kept per site, i.e., the operation the thread is in, as set by
+ * pbuf_set_site(), so that persistence cost can be attributed to malloc,
+ * free, cache filling/flushing, recovery and checkpoints. Writebacks are
+ * counted by the site that drains them. Counters are comparable with Makalu's
+ * MAK_total_flush_count() and MAK_local_fence_count().
+ *
+ * When the persistence policy needs no writeback, all of these return at once
+ * and nothing is counted.
+ */
+#define PBUF_CAPACITY 32
+
+enum pbuf_site {
+    PBUF_SITE_OTHER = 0, // init, close, roots, etc.
+    PBUF_SITE_MALLOC,
+    PBUF_SITE_FREE,
+    PBUF_SITE_FILL_CACHE,
+    PBUF_SITE_FLUSH_CACHE,
+    PBUF_SITE_RECOVERY,
+    PBUF_SITE_CHECKPOINT,
+    PBUF_SITE_NUM
+};
+
+struct pbuf {
+    uintptr_t lines[PBUF_CAPACITY];
+    uint32_t size;
+    uint32_t site;
+    uint64_t added_lines[PBUF_SITE_NUM];
+    uint64_t flushed_lines[PBUF_SITE_NUM];
+    uint64_t commits[PBUF_SITE_NUM];
+};
+
+/* statistics of persist buffers */
+struct pbuf_stats {
+    uint64_t added_lines[PBUF_SITE_NUM];
+    uint64_t flushed_lines[PBUF_SITE_NUM];
+    uint64_t commits[PBUF_SITE_NUM];
+};
+
+extern __thread struct pbuf _pbuf;
+
+/* add counters of the calling thread to the totals and reset them */
+void pbuf_accumulate(void);
+/* totals of exited threads plus counters of the calling thread */
+void pbuf_get_stats(struct pbuf_stats* stats);
+/* counters of the calling thread only */
+void pbuf_get_local_stats(struct pbuf_stats* stats);
+/* name of site, e.g., "malloc" */
+const char* pbuf_site_name(int site);
+
+/* set site of the calling thread and return the previous one */
+static inline int pbuf_set_site(int site) {
+    int prev = _pbuf.site;
+    _pbuf.site = site;
+    return prev;
+}
+
+static inline void pbuf_drain(void) {
+    uint32_t i;
+    if (!pwb_needs_writeback()) return;
+    for (i = 0; i < _pbuf.size; i++) {
+        FLUSH(_pbuf.lines[i]);
+    }
+    _pbuf.flushed_lines[_pbuf.site] += _pbuf.size;
+    _pbuf.size = 0;
+}
+
+static inline void pbuf_add(const void* addr, size_t len) {
+    uintptr_t line = (uintptr_t)addr & ~(uintptr_t)(PBUF_LINE_SIZE - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    uint64_t line_num = (end - line + PBUF_LINE_SIZE - 1) / PBUF_LINE_SIZE;
+    uint32_t i;
+    if (!pwb_needs_writeback()) return;
+    _pbuf.added_lines[_pbuf.site] += line_num;
+    if (line_num > PBUF_CAPACITY) {
+        for (; line < end; line += PBUF_LINE_SIZE) {
+            FLUSH(line);
+        }
+        _pbuf.flushed_lines[_pbuf.site] += line_num;
+        return;
+    }
+    for (; line < end; line += PBUF_LINE_SIZE) {
+        for (i = 0; i < _pbuf.size; i++) {
+            if (_pbuf.lines[i] == line) break;
+        }
+        if (i < _pbuf.size) continue; // already recorded
+        if (_pbuf.size == PBUF_CAPACITY) pbuf_drain();
+        _pbuf.lines[_pbuf.size++] = line;
+    }
+}
+
+static inline void pbuf_commit(void) {
+    if (!pwb_needs_writeback()) return;
+    pbuf_drain();
+    FLUSHFENCE;
+    _pbuf.commits[_pbuf.site]++;
+}
+
+/* ranges shorter than this are persisted by writeback instead of NT stores */
+#define PWB_NT_THRESHOLD 256
+
+/*
+ * Copy/set len bytes and persist them with a single fence, using
+ * non-temporal stores for large ranges. Pending lines in the persist buffer
+ * are committed as well.
+ */
+void pwb_memcpy_persist(void* dst, const void* src, size_t len);
+void pwb_memset_persist(void* dst, int c, size_t len);
+
+/* persist [addr, addr+len) with a single fence */
+static inline void pwb_persist_range(const void* addr, size_t len) {
+    pbuf_add(addr, len);
+    pbuf_commit();
+}
+
+#ifdef __cplusplus
+/* set site of the calling thread for the lifetime of the object */
+class PbufSite {
+    int prev;
+public:
+    PbufSite(int site) : prev(pbuf_set_site(site)) {}
+    ~PbufSite() { pbuf_set_site(prev); }
+};
+#endif
+
 #endif
@@ -28,6 +28,10 @@ enum RegionIndex : int {
     DESC_IDX = 0,
     SB_IDX = 1,
     META_IDX = 2,
+#ifdef SB_BITMAP
+    BITMAP_IDX = 3, // free bitmaps of superblocks, one slot per descriptor
+    CKPT_IDX = 4, // two copies of bitmap region saved by checkpoints
+#endif
     LAST_IDX // dummy index as the last
 };
 
@@ -70,6 +74,8 @@ const uint64_t MIN_SB_REGION_SIZE = 1*1024*1024*1024ULL; // min sb region size
 //const uint64_t SB_REGION_EXPAND_SIZE = MIN_SB_REGION_SIZE;
 const uint64_t SB_REGION_EXPAND_SIZE = (2097152*4);
 const int MAX_ROOTS = 1024;
+// max blocks a marking thread keeps prefetched ahead of tracing, a power of 2
+const uint32_t MARK_FIFO_SIZE = 16;
 
 /* System Macros */
 const int TYPE_SIZE = 4;
@@ -96,6 +102,16 @@ const uint64_t DESCSIZE = CACHELINE_SIZE;
 const int SB_SHIFT = 22; // assume size of a superblock is 64K
 const int DESC_SHIFT = 6; // assume size of a descriptor is 64B
 
+/*
+ * SB_BITMAP switches superblocks to bitmap format: instead of threading a
+ * pptr free list through free blocks, each descriptor owns a slot in the
+ * bitmap region with one bit per block (1 means free). A slot is big enough
+ * for the smallest size class.
+ */
+const uint64_t MIN_BLOCK_SIZE = 8;
+const uint64_t SB_BITMAP_WORDS = SBSIZE/MIN_BLOCK_SIZE/64; // uint64_t per slot
+const uint64_t SB_BITMAP_SIZE = SB_BITMAP_WORDS*sizeof(uint64_t); // 64K
+
 
 /* Consts Determined by Customizable Values */
 const uint64_t MAX_DESC_AMOUNT = 1ULL<<MAX_DESC_AMOUNT_BITS; // maximum of superblocks in region
@@ -6,17 +6,24 @@
 
 #include "ralloc.hpp"
 
+#include <omp.h>
+
 #include <string>
 #include <functional>
 #include <atomic>
 #include <vector>
 #include <algorithm>
 #include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "RegionManager.hpp"
 #include "BaseMeta.hpp"
 #include "SizeClass.hpp"
 #include "pm_config.hpp"
+#include "pfence_util.h"
 
 using namespace std;
 
@@ -25,7 +32,24 @@ namespace ralloc{
     /* persistent metadata and their layout */
     BaseMeta* base_md;
     Regions* _rgs;
-    std::function<void(const CrossPtr<char, SB_IDX>&, GarbageCollection&)> roots_filter_func[MAX_ROOTS];
+    uint32_t roots_type[MAX_ROOTS];
+    std::atomic<GarbageCollection*> lazy_gc(nullptr);
+    RP_recovery_stats recovery_stats;
+    int verbose = 0;
+    uint32_t mark_prefetch = 8;
+    TraceFunc tracers[MAX_TRACERS] = {
+        [](char* ptr, GarbageCollection& gc){ gc.filter_func(ptr); }
+    };
+    std::atomic<uint32_t> tracer_num(1);
+    uint32_t register_tracer(TraceFunc tracer){
+        uint32_t id = tracer_num.fetch_add(1);
+        if(id >= MAX_TRACERS) {
+            fprintf(stderr, "Too many types traced by GC, max %u\n", MAX_TRACERS);
+            abort();
+        }
+        tracers[id] = tracer;
+        return id;
+    }
     extern SizeClass sizeclass;
 };
 using namespace ralloc;
@@ -38,12 +62,27 @@ int _RP_init(const char* _id, uint64_t size, int* pre_fault){
 
     // reinitialize global variables in case they haven't
     new (&sizeclass) SizeClass();
+    pwb_policy_init();
+    const char* env = getenv("RALLOC_VERBOSE");
+    if(env != nullptr && *env != '\0') verbose = atoi(env);
+    env = getenv("RALLOC_MARK_PREFETCH");
+    if(env != nullptr && *env != '\0') mark_prefetch = atoi(env);
+    DBG_PRINT("persistence domain: %s\n", pwb_domain_name(_pwb_policy.domain));
+#ifdef PWB_IS_RUNTIME
+    // pick flush instruction before anything is written back
+    pwb_init();
+    DBG_PRINT("flush instruction: %s\n", pwb_name(_pwb_kind));
+#elif defined(PWB_IS_PCM)
+    pwb_calibrate_tsc();
+    DBG_PRINT("TSC cycles per us: %lu\n", _pwb_emu.cycles_per_us);
+#endif
 
     filepath = HEAPFILE_PREFIX + id;
     assert(sizeof(Descriptor) == DESCSIZE); // check desc size
     assert(size < MAX_SB_REGION_SIZE && size >= MIN_SB_REGION_SIZE); // ensure user input is >=MAX_SB_REGION_SIZE
     uint64_t num_sb = size/SBSIZE;
     bool restart = Regions::exists_test(filepath+"_basemd");
+    bool sb_existed = Regions::exists_test(filepath+"_sb");
     _rgs = new Regions();
     for(int i=0; i<LAST_IDX;i++){
     switch(i){
@@ -56,24 +95,103 @@ int _RP_init(const char* _id, uint64_t size, int* pre_fault){
     case META_IDX:
         base_md = _rgs->create_for<BaseMeta>(filepath+"_basemd", sizeof(BaseMeta), true,pre_fault);
         break;
+#ifdef SB_BITMAP
+    case BITMAP_IDX:
+        _rgs->create(filepath+"_bitmap", num_sb*SB_BITMAP_SIZE, true, true,pre_fault);
+        break;
+    case CKPT_IDX:
+        // two copies after a page of region metadata, touched by checkpoints only
+        _rgs->create(filepath+"_ckpt", 2*num_sb*SB_BITMAP_SIZE+PAGESIZE, true, true);
+        break;
+#endif
     } // switch
     }
+    // a heap of another layout would be misread, and nothing else detects it
+    if(restart && base_md->layout != BaseMeta::LAYOUT) {
+        fprintf(stderr, "Heap %s was created by an incompatible build of Ralloc "
+            "(layout %lx, expected %lx); recreate it\n", _id,
+            base_md->layout, BaseMeta::LAYOUT);
+        abort();
+    }
+    // transient state of the last run is stale
+    base_md->xiaoxiang_gc = new GarbageCollection();
+    // pre-faulting writes to every page, so no sb is zero any more
+    if(pre_fault != nullptr && *pre_fault != 0)
+        base_md->clear_fresh_sb();
+    // the sb file may be left without metadata, e.g., by an interrupted
+    // deletion, in which case its content is unknown
+    if(!restart && sb_existed)
+        base_md->clear_fresh_sb();
+    // track metadata written from now on so that shutdown and GC only flush
+    // those parts
+    _rgs->track_dirty(DESC_IDX, DESCSIZE);
+#ifdef SB_BITMAP
+    _rgs->track_dirty(BITMAP_IDX, SB_BITMAP_SIZE);
+#else
+    _rgs->track_dirty(SB_IDX, PAGESIZE);
+#endif
     initialized = true;
     return (int)restart;
 }
 
+#ifdef SB_BITMAP
+/*
+ * background checkpointing, started by RP_checkpoint_every and stopped by
+ * it or on close
+ */
+static std::thread ckpt_thread;
+static std::mutex ckpt_thread_mtx;
+static std::condition_variable ckpt_cv;
+static uint64_t ckpt_interval_ms = 0;
+
+static void ckpt_stop(){
+    {
+        std::lock_guard<std::mutex> lk(ckpt_thread_mtx);
+        ckpt_interval_ms = 0;
+    }
+    ckpt_cv.notify_all();
+    if(ckpt_thread.joinable()) ckpt_thread.join();
+}
+
+static void ckpt_loop(){
+    std::unique_lock<std::mutex> lk(ckpt_thread_mtx);
+    while(ckpt_interval_ms != 0) {
+        if(ckpt_cv.wait_for(lk, std::chrono::milliseconds(ckpt_interval_ms)) ==
+            std::cv_status::timeout && ckpt_interval_ms != 0) {
+            lk.unlock();
+            base_md->checkpoint();
+            lk.lock();
+        }
+    }
+}
+#endif
+
 struct RallocHolder{
     int init_ret_val;
     RallocHolder(const char* _id, uint64_t size, int* pre_fault){
         init_ret_val = _RP_init(_id,size, pre_fault);
     }
     ~RallocHolder(){
+#ifdef SB_BITMAP
+        ckpt_stop();
+#endif
+        // finish lazy recovery so that every sb is rebuilt before flush
+        GarbageCollection* gc = lazy_gc.exchange(nullptr);
+        delete gc;
+        delete base_md->xiaoxiang_gc;
+        base_md->xiaoxiang_gc = nullptr;
         // #ifndef MEM_CONSUME_TEST
         // flush_region would affect the memory consumption result (rss) and 
         // thus is disabled for benchmark testing. To enable, simply comment out
         // -DMEM_CONSUME_TEST flag in Makefile.
-        _rgs->flush_region(DESC_IDX);
-        _rgs->flush_region(SB_IDX);
+        // only parts written since start are flushed
+        _rgs->flush_dirty(DESC_IDX);
+#ifdef SB_BITMAP
+        // free blocks carry no metadata in bitmap format
+        _rgs->flush_dirty(BITMAP_IDX);
+#else
+        _rgs->flush_dirty(SB_IDX);
+#endif
         // #endif
         base_md->writeback();
         initialized = false;
@@ -94,52 +212,160 @@ int RP_init(const char* _id, uint64_t size, int* pre_fault){
 
 /**
  * start xiaoxiang scan recovery feature
+ *
+ * Superblocks are handed out to scanning threads RP_SCAN_CHUNK at a time by
+ * fetch_add on RP_scan_cursor. Each thread keeps the rest of its chunk, and
+ * where it stopped in a superblock, in RP_scan_local.
  */
 
-pthread_mutex_t RP_scan_lock;
-Descriptor* RP_scan_current=NULL;
-
+static const uint64_t RP_SCAN_CHUNK = 16;
+static std::atomic<uint64_t> RP_scan_cursor(1); // sb 0 is never handed out
+// bumped by RP_scan_init so that threads drop state of the last scan
+static std::atomic<uint64_t> RP_scan_gen(0);
+struct RP_scan_state{
+    uint64_t gen = 0;
+    uint64_t next = 0; // next sb of the chunk
+    uint64_t end = 0; // end of the chunk
+    uint32_t block = 0; // next block of sb next, with RP_SCAN_ALLOCATED
+    std::vector<uint64_t> free_bits; // free blocks of sb next
+};
+static thread_local RP_scan_state RP_scan_local;
 
 void RP_scan_init(){
-
-    pthread_mutex_init(&RP_scan_lock,NULL);
-    RP_scan_current = reinterpret_cast<Descriptor*>(_rgs->lookup(DESC_IDX));
+    RP_scan_cursor.store(1);
+    RP_scan_gen.fetch_add(1);
 }
 
-struct RP_scan_pack RP_scan_next(){
-
-    Descriptor* ret;
-
-    pthread_mutex_lock(&RP_scan_lock);
-
-    while (1){
+// set bits of free blocks of the sb desc describes, as its metadata records
+static void RP_scan_free_bits(Descriptor* desc, std::vector<uint64_t>& bits){
+    uint32_t const maxcount = desc->maxcount;
+    bits.assign((maxcount + 63) / 64, 0);
+#ifdef SB_BITMAP
+    std::atomic<uint64_t>* bitmap = base_md->bitmap_lookup(desc);
+    for(size_t w = 0; w < bits.size(); w++) {
+        bits[w] = bitmap[w].load(memory_order_relaxed);
+    }
+#else
+    Anchor anchor = desc->anchor.load();
+    if(anchor.state != SB_PARTIAL) return;
+    char* superblock = desc->superblock;
+    uint32_t const block_size = desc->block_size;
+    char* sb_end = superblock + (uint64_t)maxcount * block_size;
+    uint64_t idx = anchor.avail;
+    for(uint32_t i = 0; i < anchor.count && idx < maxcount; i++) {
+        bits[idx / 64] |= 1ULL << (idx % 64);
+        char* next = static_cast<char*>(*reinterpret_cast<pptr<char>*>(superblock + idx * block_size));
+        if(next < superblock || next >= sb_end) break;
+        idx = (uint64_t)(next - superblock) / block_size;
+    }
+#endif
+}
 
-        ret=NULL;
+// first block from b whose free bit is free, or maxcount if none
+static uint32_t RP_scan_find(const std::vector<uint64_t>& bits, uint32_t b,
+    uint32_t maxcount, bool free){
+    while(b < maxcount) {
+        uint64_t word = free ? bits[b / 64] : ~bits[b / 64];
+        word >>= b % 64;
+        if(word != 0) return std::min(b + (uint32_t)__builtin_ctzll(word), maxcount);
+        b = (b / 64 + 1) * 64;
+    }
+    return maxcount;
+}
 
-        if (!_rgs->in_range(DESC_IDX,RP_scan_current)){
-            break;
+int RP_scan_batch(struct RP_scan_pack* packs, int max, int flags){
+    RP_scan_state& s = RP_scan_local;
+    uint64_t gen = RP_scan_gen.load();
+    if(s.gen != gen) {
+        s.gen = gen;
+        s.next = s.end = 0;
+        s.block = 0;
+    }
+    char* sb_base = _rgs->lookup(SB_IDX);
+    uint64_t sb_num = (uint64_t)(_rgs->regions[SB_IDX]->curr_addr_ptr->load() - sb_base) >> SB_SHIFT;
+    int n = 0;
+    while(n < max) {
+        if(s.next == s.end) {
+            uint64_t start = RP_scan_cursor.fetch_add(RP_SCAN_CHUNK);
+            if(start >= sb_num) break;
+            s.next = start;
+            s.end = std::min(start + RP_SCAN_CHUNK, sb_num);
+            s.block = 0;
         }
-
-        ret = RP_scan_current;
-        RP_scan_current++;
-
-        if (_rgs->in_range(SB_IDX,ret->superblock)){
-            break;
+        char* sb = sb_base + (s.next << SB_SHIFT);
+        Descriptor* desc = base_md->desc_lookup(sb);
+        // skip free sbs, and sbs of a large block but the first
+        if(desc->heap == nullptr || desc->superblock != sb ||
+            desc->anchor.load().state == SB_EMPTY) {
+            s.next++;
+            continue;
+        }
+        uint32_t const block_size = desc->block_size;
+        uint32_t const maxcount = desc->maxcount;
+        // a large block is a single block
+        if(!(flags & RP_SCAN_ALLOCATED) || block_size > MAX_SZ) {
+            packs[n++] = {sb, block_size, sb + (uint64_t)maxcount * block_size};
+            s.next++;
+            continue;
+        }
+        // yield the next run of allocated blocks
+        if(s.block == 0) RP_scan_free_bits(desc, s.free_bits);
+        uint32_t first = RP_scan_find(s.free_bits, s.block, maxcount, false);
+        uint32_t last = RP_scan_find(s.free_bits, first, maxcount, true);
+        if(first < maxcount) {
+            packs[n++] = {sb + (uint64_t)first * block_size, block_size,
+                sb + (uint64_t)last * block_size};
+        }
+        if(last >= maxcount) {
+            s.next++;
+            s.block = 0;
+        } else {
+            s.block = last;
         }
     }
+    return n;
+}
 
-    pthread_mutex_unlock(&RP_scan_lock);
-
+struct RP_scan_pack RP_scan_next(){
     struct RP_scan_pack pack;
     memset(&pack,0,sizeof(struct RP_scan_pack));
+    RP_scan_batch(&pack, 1, 0);
+    return pack;
+}
 
-    if (ret!=NULL){
-        pack.block_size=ret->block_size;
-        pack.curr=ret->superblock;
-        pack.end = pack.curr + ret->maxcount * ret->block_size;
-    }
+// packs claimed at a time, and blocks prefetched ahead, by RP_for_each_allocated
+static const int RP_VISIT_BATCH = 32;
+static const uint64_t RP_VISIT_PREFETCH = 4;
 
-    return pack;
+uint64_t RP_for_each_allocated(void (*callback)(void* ptr, size_t size, void* arg),
+    void* arg, int thread_num){
+    assert(initialized&&"RPMalloc isn't initialized!");
+    if(thread_num <= 0) thread_num = omp_get_max_threads();
+    // metadata of sbs a lazy recovery hasn't swept yet is stale
+    GarbageCollection* gc = lazy_gc.load();
+    if(gc != nullptr) gc->finish_lazy();
+    uint64_t visited = 0;
+    RP_scan_init();
+#pragma omp parallel num_threads(thread_num) reduction(+:visited)
+    {
+        struct RP_scan_pack packs[RP_VISIT_BATCH];
+        int n;
+        while((n = RP_scan_batch(packs, RP_VISIT_BATCH, RP_SCAN_ALLOCATED)) > 0) {
+            for(int k = 0; k < n; k++) {
+                char* end = packs[k].end;
+                uint64_t const block_size = packs[k].block_size;
+                // the next run is usually close, but not in this one
+                if(k + 1 < n) __builtin_prefetch(packs[k + 1].curr);
+                for(char* blk = packs[k].curr; blk < end; blk += block_size) {
+                    char* ahead = blk + RP_VISIT_PREFETCH * block_size;
+                    if(ahead < end) __builtin_prefetch(ahead);
+                    callback(blk, block_size, arg);
+                    visited++;
+                }
+            }
+        }
+    }
+    return visited;
 }
 
 /**
@@ -149,11 +375,90 @@ struct RP_scan_pack RP_scan_next(){
 
 
 
+// finish and forget the last recovery; GC fills in a new one if there's any
+static void reset_recovery_stats(){
+    // a lazy recovery still sweeping would race with the new one
+    GarbageCollection* gc = lazy_gc.exchange(nullptr);
+    delete gc;
+    memset(&recovery_stats, 0, sizeof(recovery_stats));
+}
+
 int RP_recover(){
+    reset_recovery_stats();
     return (int) base_md->restart();
 }
 
+int RP_recover_threads(int thread_num){
+    reset_recovery_stats();
+    return (int) base_md->restart(thread_num);
+}
+
+int RP_recover_lazy(int thread_num){
+    reset_recovery_stats();
+    return (int) base_md->restart_lazy(thread_num);
+}
+
+int RP_recovery_pending(){
+    GarbageCollection* gc = lazy_gc.load();
+    return gc != nullptr && gc->is_lazy_pending();
+}
+
+int RP_compact(int thread_num){
+    reset_recovery_stats();
+    return (int) base_md->restart_compact(thread_num);
+}
+
+int RP_recover_checkpoint(int thread_num){
+    reset_recovery_stats();
+    return (int) base_md->restart_checkpoint(thread_num);
+}
+
+void RP_get_recovery_stats(struct RP_recovery_stats* stats){
+    GarbageCollection* gc = lazy_gc.load();
+    if(gc != nullptr) {
+        gc->get_stats(stats);
+    } else {
+        *stats = recovery_stats;
+    }
+}
+
+static_assert(RP_SC_NUM == MAX_SZ_IDX, "RP_SC_NUM must match MAX_SZ_IDX");
+
+int RP_check(struct RP_check_report* report, int thread_num){
+    assert(initialized&&"RPMalloc isn't initialized!");
+    return base_md->check(report, thread_num) != 0;
+}
+
+void RP_set_verbose(int level){
+    verbose = level;
+}
+
+uint64_t RP_checkpoint(){
+    assert(initialized&&"RPMalloc isn't initialized!");
+#ifdef SB_BITMAP
+    return base_md->checkpoint();
+#else
+    return 0;
+#endif
+}
+
+int RP_checkpoint_every(uint64_t interval_ms){
+    assert(initialized&&"RPMalloc isn't initialized!");
+#ifdef SB_BITMAP
+    ckpt_stop();
+    if(interval_ms != 0) {
+        ckpt_interval_ms = interval_ms;
+        ckpt_thread = std::thread(ckpt_loop);
+    }
+    return 0;
+#else
+    (void)interval_ms;
+    return 1;
+#endif
+}
+
 int RP_recover_xiaoxiang(void** pointers,int pointers_count){
+    reset_recovery_stats();
     return (int) base_md->restart_xiaoxiang(pointers,pointers_count);
 }
 
@@ -162,6 +467,7 @@ void RP_recover_xiaoxiang_insert(void* ptr){
 }
 
 int RP_recover_xiaoxiang_go(){
+    reset_recovery_stats();
     return (int) base_md->restart_xiaoxiang_go();
 }
 
@@ -207,23 +513,48 @@ void* RP_realloc(void* ptr, size_t new_size){
     }
     void* new_ptr = RP_malloc(new_size);
     if(UNLIKELY(new_ptr == nullptr)) return nullptr;
-    memcpy(new_ptr, ptr, old_size);
-    FLUSH(new_ptr);
-    FLUSHFENCE;
+    // new block may be smaller when shrinking
+    size_t copy_size = std::min(old_size, RP_malloc_size(new_ptr));
+    RP_memcpy_persist(new_ptr, ptr, copy_size);
     RP_free(ptr);
     return new_ptr;
 }
 
 void* RP_calloc(size_t num, size_t size){
-    void* ptr = RP_malloc(num*size);
+    assert(initialized&&"RPMalloc isn't initialized!");
+    bool fresh = false;
+    void* ptr = base_md->do_malloc(num*size, fresh);
     if(UNLIKELY(ptr == nullptr)) return nullptr;
+    // blocks never used since the heap file was created are already zero
+    if(fresh) return ptr;
     size_t real_size = RP_malloc_size(ptr);
-    memset(ptr, 0, real_size);
-    FLUSH(ptr);
-    FLUSHFENCE;
+    RP_memset_persist(ptr, 0, real_size);
     return ptr;
 }
 
+void* RP_memcpy_persist(void* dst, const void* src, size_t len){
+    pwb_memcpy_persist(dst, src, len);
+    return dst;
+}
+
+void* RP_memset_persist(void* dst, int c, size_t len){
+    pwb_memset_persist(dst, c, len);
+    return dst;
+}
+
+void RP_persist_range(const void* addr, size_t len){
+    pwb_persist_range(addr, len);
+}
+
+int RP_persist_domain(){
+    return _pwb_policy.domain;
+}
+
+void RP_get_pwb_stats(struct pbuf_stats* stats, int local){
+    if(local) pbuf_get_local_stats(stats);
+    else pbuf_get_stats(stats);
+}
+
 int RP_in_prange(void* ptr){
     if(_rgs->in_range(SB_IDX,ptr)) return 1;
     else return 0;
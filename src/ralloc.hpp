@@ -10,6 +10,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* defined in pfence_util.h, with enum pbuf_site that indexes it */
+struct pbuf_stats;
+
 #ifdef __cplusplus
 /* return 1 if it's a restart, otherwise 0. */
 extern "C" int RP_init(const char* _id, uint64_t size = 5*1024*1024*1024ULL, int* pre_fault=nullptr);
@@ -39,12 +42,148 @@ struct RP_scan_pack{
     uint32_t block_size;
     char* end;
 };
+/* start a scan; call before any thread scans */
 void RP_scan_init();
+/* next superblock in use, or a pack of nulls once all are handed out */
 struct RP_scan_pack RP_scan_next();
+/* flags of RP_scan_batch */
+#define RP_SCAN_ALLOCATED 1
+/*
+ * write up to max packs to packs and return the number written, 0 once the
+ * scan is done. Threads claim superblocks in chunks without locking. Each
+ * pack is a superblock in use, or with RP_SCAN_ALLOCATED, a run of blocks in
+ * it that are allocated by its metadata (blocks in thread caches count). The
+ * latter needs a heap that isn't changing.
+ */
+int RP_scan_batch(struct RP_scan_pack* packs, int max, int flags);
+/*
+ * call callback(ptr, size, arg) on every allocated block on thread_num
+ * threads (0 for all available) and return the number of blocks visited.
+ * Blocks are told by the metadata rebuilt by RP_recover*, so call it after
+ * that and while the heap isn't changing. After RP_recover_lazy, it waits
+ * for the sweep first. It uses the scan of RP_scan_batch,
+ * so the two can't overlap.
+ */
+uint64_t RP_for_each_allocated(void (*callback)(void* ptr, size_t size, void* arg),
+    void* arg, int thread_num);
 
 
 /* return 1 if it's dirty, otherwise 0. */
 int RP_recover();
+/* RP_recover, marking with thread_num threads; 0 uses all available. */
+int RP_recover_threads(int thread_num);
+/*
+ * lazy RP_recover: return once reachable blocks are marked, and rebuild
+ * superblocks in background or on demand. Only roots and blocks reachable
+ * from them may be used meanwhile, as before any recovery. Any later
+ * RP_recover* call waits for the sweep first.
+ */
+int RP_recover_lazy(int thread_num);
+/* return 1 if a lazy recovery is still sweeping, otherwise 0. */
+int RP_recovery_pending();
+/*
+ * RP_recover from the last checkpoint instead of marking, so its cost follows
+ * superblocks changed since then. Free blocks in those are kept in use until
+ * the next RP_recover, which collects them even after a clean shutdown.
+ * Without a checkpoint, or without SB_BITMAP, it's the same as
+ * RP_recover_threads.
+ */
+int RP_recover_checkpoint(int thread_num);
+/*
+ * save free bitmaps of all superblocks and return the checkpoint epoch, or 0
+ * if it's not supported (no SB_BITMAP) or a lazy recovery is pending. It may
+ * run concurrently with malloc and free.
+ */
+uint64_t RP_checkpoint();
+/*
+ * take a checkpoint every interval_ms in background, or stop if 0. return 1
+ * if checkpoints aren't supported, otherwise 0.
+ */
+int RP_checkpoint_every(uint64_t interval_ms);
+/*
+ * RP_recover_threads with a GC that also compacts, even after a clean
+ * shutdown: live blocks of each size class are moved into as few
+ * superblocks as possible, and pages of the superblocks left free at the end
+ * of the sb region are given back to the file system. Only blocks whose
+ * pptrs are all marked by filter functions with mark_field() are moved; see
+ * class GarbageCollection. Call it offline, right after RP_init and
+ * RP_get_root of each root. The heap is marked dirty, and persisted so,
+ * before anything is moved, so a crash during it leaves a dirty heap that the
+ * next RP_init recovers with a full GC.
+ */
+int RP_compact(int thread_num);
+/* kinds of recovery in struct RP_recovery_stats */
+#define RP_RECOVERY_NONE 0 /* clean restart, nothing to recover */
+#define RP_RECOVERY_GC 1
+#define RP_RECOVERY_LAZY 2
+#define RP_RECOVERY_CHECKPOINT 3
+#define RP_RECOVERY_COMPACT 4
+/*
+ * what the last RP_recover* did. Times are in microseconds; total_us is until
+ * it returned. A lazy recovery fills in sweep_us and superblock counts once
+ * its background sweep is done. A checkpoint recovery marks nothing, so
+ * reachable_* and reclaimed_bytes are 0, and counts first superblocks of
+ * blocks only.
+ */
+struct RP_recovery_stats{
+    int kind;
+    int thread_num;
+    uint64_t mark_us;
+    uint64_t sweep_us;
+    uint64_t flush_us;
+    uint64_t total_us;
+    uint64_t reachable_blocks;
+    uint64_t reachable_bytes;
+    /* bytes of free blocks in superblocks that were in use before */
+    uint64_t reclaimed_bytes;
+    /* superblocks rebuilt as full, partial and empty */
+    uint64_t sb_full;
+    uint64_t sb_partial;
+    uint64_t sb_empty;
+    /*
+     * for RP_compact: time on moving blocks, blocks moved and their bytes,
+     * small blocks pinned in place, and bytes of sb region given back
+     */
+    uint64_t move_us;
+    uint64_t moved_blocks;
+    uint64_t moved_bytes;
+    uint64_t pinned_blocks;
+    uint64_t released_bytes;
+};
+void RP_get_recovery_stats(struct RP_recovery_stats* stats);
+/*
+ * 0 (default) keeps recovery quiet, 1 prints a summary of each recovery,
+ * and 2 its progress too. RP_init sets it from RALLOC_VERBOSE.
+ */
+void RP_set_verbose(int level);
+/* number of size classes in struct RP_check_report; 0 is for large blocks */
+#define RP_SC_NUM 40
+struct RP_sc_usage{
+    uint32_t block_size; /* 0 for large blocks */
+    uint64_t sb_num;
+    uint64_t block_num;
+    /* free blocks; 0 if the heap is dirty */
+    uint64_t free_num;
+};
+struct RP_check_report{
+    /* not shut down cleanly, so only persistent metadata was checked */
+    int dirty;
+    /* superblocks handed out from the sb region, and those not in use */
+    uint64_t sb_num;
+    uint64_t sb_free;
+    /* inconsistencies found, each printed if RP_set_verbose is 1 or more */
+    uint64_t errors;
+    struct RP_sc_usage sc[RP_SC_NUM];
+};
+/*
+ * check descriptors, anchors, free blocks and lists of all superblocks on
+ * thread_num threads (0 for all available), fill in report, and return 1 if
+ * any is inconsistent, otherwise 0. Nothing is written and the heap must not
+ * be changing. It may be called before RP_recover*, which then still finds
+ * the heap dirty; to leave a dirty heap unrecovered, end the process with
+ * _exit() so that it isn't written back as clean.
+ */
+int RP_check(struct RP_check_report* report, int thread_num);
 int RP_recover_xiaoxiang(void** pointers,int pointers_count);
 
 void RP_recover_xiaoxiang_insert(void* ptr);
@@ -61,6 +200,24 @@ void* RP_realloc(void* ptr, size_t new_size);
 int RP_in_prange(void* ptr);
 /* return 1 if the query is invalid, otherwise 0 and write start and end addr to the parameter. */
 int RP_region_range(int idx, void** start_addr, void** end_addr);
+/* 
+ * write flush (cache line writeback) and fence counters, per site listed in
+ * enum pbuf_site, to stats. If local is 1, only the calling thread is counted;
+ * otherwise exited threads and the calling thread are counted.
+ */
+void RP_get_pwb_stats(struct pbuf_stats* stats, int local);
+/*
+ * persistence domain in use, one of enum pwb_domain, as set from
+ * RALLOC_PERSIST_DOMAIN by RP_init.
+ */
+int RP_persist_domain();
+/*
+ * persistent versions of memcpy and memset, and writeback of a range. Each
+ * issues a single fence; large ranges are written with non-temporal stores.
+ */
+void* RP_memcpy_persist(void* dst, const void* src, size_t len);
+void* RP_memset_persist(void* dst, int c, size_t len);
+void RP_persist_range(const void* addr, size_t len);
 #ifdef __cplusplus
 }
 #endif
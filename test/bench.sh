@@ -0,0 +1,175 @@
+#!/bin/bash
+
+# run allocator benchmarks against allocators and write one csv and one json
+# file with a row per run. see usage below.
+
+usage() {
+  echo "usage: bench.sh [-a allocators] [-w workloads] [-t threads] [-n runs]"
+  echo "                [-o name] [-B]"
+  echo ""
+  echo "  -a: allocators to build with, as ALLOC of make (default: r)"
+  echo "  -w: workloads among threadtest shbench larson prod-con (default: all)"
+  echo "  -t: thread counts (default: powers of two up to the number of cpus)"
+  echo "  -n: runs of each configuration (default: 3)"
+  echo "  -o: results go to ../data/bench/<name>.csv and .json, and latency"
+  echo "      histograms of each run to ../data/bench/<name>_hist/ (default: bench)"
+  echo "  -B: don't build; use the binaries in this directory (one allocator)"
+  echo ""
+  echo "Arguments of each workload can be replaced by THREADTEST_ARGS,"
+  echo "SHBENCH_ARGS, LARSON_ARGS and PRODCON_ARGS, where %T is the thread"
+  echo "count. Odd thread counts are skipped for prod-con. BENCH_LAT_SAMPLE"
+  echo "sets how often malloc and free are timed, see benchmark/LatencyHistogram.hpp."
+  echo ""
+  echo "example:"
+  echo "  ./bench.sh -a \"r lr\" -w \"larson threadtest\" -t \"1 4 16\" -n 5"
+  exit 1
+}
+
+ALLOCS="r"
+WORKLOADS="threadtest shbench larson prod-con"
+THREADS=""
+RUNS=3
+NAME="bench"
+BUILD=1
+while getopts "a:w:t:n:o:B" opt; do
+  case $opt in
+    a) ALLOCS=$OPTARG;;
+    w) WORKLOADS=$OPTARG;;
+    t) THREADS=$OPTARG;;
+    n) RUNS=$OPTARG;;
+    o) NAME=$OPTARG;;
+    B) BUILD=0;;
+    *) usage;;
+  esac
+done
+if [[ $OPTIND -le $# ]]; then
+  usage
+fi
+if [[ -z $THREADS ]]; then
+  CPUS=$(nproc)
+  for ((t = 1; t <= CPUS; t *= 2)); do
+    THREADS="$THREADS $t"
+  done
+fi
+
+# heap files the benchmarks create, in each place an allocator may put them
+HEAP_FILES="test_basemd test_desc test_sb test_bitmap test_ckpt gc_heap_wcai6 pmdk_heap_wcai6"
+HEAP_DIRS="/dev/shm /mnt/pmem /pmem0"
+
+remove_heaps() {
+  for dir in $HEAP_DIRS; do
+    for f in $HEAP_FILES; do
+      rm -f $dir/$f
+    done
+  done
+}
+
+binary_of() {
+  case $1 in
+    threadtest) echo "threadtest_test";;
+    shbench) echo "sh6bench_test";;
+    larson) echo "larson_test";;
+    prod-con) echo "prod-con_test";;
+    *) echo "unknown workload $1" >&2; exit 1;;
+  esac
+}
+
+# run workload $1 with $2 threads, output to $3
+run_one() {
+  local args
+  case $1 in
+    threadtest)
+      args=${THREADTEST_ARGS:-"%T 10000 100000 0 8"}
+      ./threadtest_test ${args//%T/$2} > $3
+      ;;
+    shbench)
+      # sh6bench reads call count, min and max size, and threads from stdin
+      args=${SHBENCH_ARGS:-"100000 64 400 %T"}
+      echo ${args//%T/$2} | tr ' ' '\n' | ./sh6bench_test > $3
+      ;;
+    larson)
+      args=${LARSON_ARGS:-"30 64 400 1000 10000 123 %T"}
+      ./larson_test ${args//%T/$2} > $3
+      ;;
+    prod-con)
+      args=${PRODCON_ARGS:-"%T 10000000 64"}
+      ./prod-con_test ${args//%T/$2} > $3
+      ;;
+  esac
+}
+
+# value after "<key> = " in $2, NA if missing
+field() {
+  local v
+  v=$(awk -v key="$1" 'index($0, key " = ") == 1 {
+      split(substr($0, length(key) + 4), a, " "); print a[1]; exit }' $2)
+  echo ${v:-NA}
+}
+
+# p50, p99 and p99.9 of "<op> latency p50/p99/p99.9 = a/b/c ns" in $2
+latency() {
+  local v
+  v=$(field "$1 latency p50/p99/p99.9" $2)
+  if [[ $v == NA ]]; then
+    echo "NA,NA,NA"
+  else
+    echo ${v//\//,}
+  fi
+}
+
+COLUMNS="workload,allocator,threads,run,throughput,time,malloc_p50_ns,malloc_p99_ns,malloc_p999_ns,free_p50_ns,free_p99_ns,free_p999_ns,max_rss_kb,heap_file_kb,flushes,fences"
+HIST=../data/bench/${NAME}_hist
+mkdir -p $HIST
+CSV=../data/bench/${NAME}.csv
+JSON=../data/bench/${NAME}.json
+OUT=/tmp/bench_out
+echo $COLUMNS > $CSV
+
+for alloc in $ALLOCS; do
+  if [[ $BUILD -eq 1 ]]; then
+    targets=""
+    for w in $WORKLOADS; do
+      targets="$targets $(binary_of $w)"
+    done
+    make clean_build > /dev/null
+    make $targets ALLOC=$alloc > /dev/null || exit 1
+  fi
+  for w in $WORKLOADS; do
+    for threads in $THREADS; do
+      if [[ $w == prod-con && $((threads % 2)) -ne 0 ]]; then
+        continue
+      fi
+      for ((run = 1; run <= RUNS; run++)); do
+        remove_heaps
+        BENCH_LAT_HIST=$HIST/${w}_${alloc}_${threads}_${run}.csv run_one $w $threads $OUT
+        time=$(field "Time elapsed" $OUT)
+        if [[ $time == NA ]]; then
+          time=$(awk '/^rdtsc time:/ {print $3}' $OUT)
+        fi
+        row="$w,$alloc,$threads,$run,$(field Throughput $OUT),${time:-NA}"
+        row="$row,$(latency Malloc $OUT),$(latency Free $OUT)"
+        row="$row,$(field "Max RSS" $OUT),$(field "Heap file usage" $OUT)"
+        row="$row,$(field Flushes $OUT),$(field Fences $OUT)"
+        echo $row
+        echo $row >> $CSV
+      done
+    done
+  done
+done
+remove_heaps
+
+# the same rows as an array of objects; NA becomes null
+awk -F, 'NR == 1 { for (i = 1; i <= NF; i++) key[i] = $i; print "["; next }
+  {
+    if (NR > 2) print ",";
+    printf "  {";
+    for (i = 1; i <= NF; i++) {
+      v = $i;
+      if (v == "NA") v = "null";
+      else if (i <= 2) v = "\"" v "\"";
+      printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], v;
+    }
+    printf "}";
+  }
+  END { print ""; print "]" }' $CSV > $JSON
+echo "Results are in $CSV and $JSON."
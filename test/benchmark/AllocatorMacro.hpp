@@ -9,7 +9,15 @@
 #include "pfence_util.h"
 
 #include <cassert>
+#include <cinttypes>
+#include <cstdio>
 #include <cstdlib>
+#include <string>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "cpuinfo.h"
 
 #ifndef THREAD_PINNING
 #define THREAD_PINNING
@@ -50,6 +58,27 @@ static const int pinning_map_2x10c[] = {
  	1,3,5,7,9,11,13,15,17,19,
  	21,23,25,27,29,31,33,35,37,39};
 
+// pin the calling thread by PINNING_MAP on the machine it's made for (80
+// cpus), or round robin on any other
+inline void pm_pin_thread(int task_id) {
+  int num_cpus = HL::CPUInfo::getNumProcessors();
+  int core_id = num_cpus == 80 ? PINNING_MAP[task_id%80] : task_id%num_cpus;
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(core_id, &cpuset);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0){
+    fprintf(stderr, "setaffinity failed for thread %d to cpu %d\n", task_id, core_id);
+    exit(1);
+  }
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0){
+    fprintf(stderr, "getaffinity failed for thread %d to cpu %d\n", task_id, core_id);
+    exit(1);
+  }
+  if (!CPU_ISSET(core_id, &cpuset)){
+    fprintf(stderr, "WARNING: thread aiming for cpu %d is pinned elsewhere.\n", core_id);
+  }
+}
+
 #endif
 volatile static int init_count = 0;
 
@@ -71,6 +100,31 @@ volatile static int init_count = 0;
     return RP_get_root<T>(i);
   }
   inline void pm_set_root(void* ptr, unsigned int i) { RP_set_root(ptr, i); }
+  // print flushes and fences issued by all threads, per site and in total
+  inline void pm_print_pwb_stats() {
+    struct pbuf_stats stats;
+    uint64_t flushes = 0, fences = 0;
+    RP_get_pwb_stats(&stats, 0);
+    for (int i = 0; i < PBUF_SITE_NUM; i++) {
+      printf("Flushes/fences in %s = %" PRIu64 "/%" PRIu64 "\n",
+        pbuf_site_name(i), stats.flushed_lines[i], stats.commits[i]);
+      flushes += stats.flushed_lines[i];
+      fences += stats.commits[i];
+    }
+    printf("Flushes = %" PRIu64 "\n", flushes);
+    printf("Fences = %" PRIu64 "\n", fences);
+  }
+  // bytes of heap files backed by storage, which are sparse until touched
+  inline int64_t pm_heap_file_bytes() {
+    static const char* suffixes[] = {"_basemd", "_desc", "_sb", "_bitmap", "_ckpt"};
+    int64_t bytes = 0;
+    struct stat st;
+    for (const char* suffix : suffixes) {
+      if (stat((std::string(HEAPFILE_PREFIX) + "test" + suffix).c_str(), &st) == 0)
+        bytes += (int64_t)st.st_blocks * 512;
+    }
+    return bytes;
+  }
 
 #elif defined(MAKALU) // RALLOC ends
 
@@ -161,6 +215,9 @@ volatile static int init_count = 0;
       return 0;
   }
   inline int pm_init() {
+#ifdef PWB_IS_RUNTIME
+    pwb_init();
+#endif
     __map_persistent_region();
     MAK_start(&__nvm_region_allocator);
     return 0;
@@ -174,6 +231,20 @@ volatile static int init_count = 0;
     return (T*)MAK_persistent_root(i);
   }
   inline void pm_set_root(void* ptr, unsigned int i) { return MAK_set_persistent_root(i, ptr); }
+  #ifdef NVM_DEBUG
+  // Makalu counts flushes only when it's built with NVM_DEBUG, and it keeps
+  // no total of fences.
+  extern "C" MAK_word MAK_total_flush_count(void);
+  inline void pm_print_pwb_stats() {
+    printf("Flushes = %llu\n", (unsigned long long)MAK_total_flush_count());
+  }
+  #else
+  inline void pm_print_pwb_stats() {}
+  #endif
+  inline int64_t pm_heap_file_bytes() {
+    struct stat st;
+    return stat(HEAP_FILE, &st) == 0 ? (int64_t)st.st_blocks * 512 : -1;
+  }
 
 #elif defined(PMDK) // MAKALU ends
 
@@ -220,6 +291,9 @@ volatile static int init_count = 0;
   }
 
   inline int pm_init() {
+#ifdef PWB_IS_RUNTIME
+    pwb_init();
+#endif
     pop = pmemobj_create(HEAP_FILE, "test", REGION_SIZE, 0666);
     if (pop == nullptr) {
       perror("pmemobj_create");
@@ -239,6 +313,11 @@ volatile static int init_count = 0;
     return (T*)((PMDK_roots*)pmemobj_direct(root))->roots[i];
   }
   inline void pm_set_root(void* ptr, unsigned int i) { ((PMDK_roots*)pmemobj_direct(root))->roots[i] = ptr; }
+  inline void pm_print_pwb_stats() {}
+  inline int64_t pm_heap_file_bytes() {
+    struct stat st;
+    return stat(HEAP_FILE, &st) == 0 ? (int64_t)st.st_blocks * 512 : -1;
+  }
 
 #else // PMDK ends
 
@@ -255,7 +334,21 @@ volatile static int init_count = 0;
     return (T*)roots[i];
   }
   inline void pm_set_root(void* ptr, unsigned int i) { roots[i] = ptr; }
+  inline void pm_print_pwb_stats() {}
+  // no heap file
+  inline int64_t pm_heap_file_bytes() { return -1; }
 
 #endif //else ends
 
+// print peak RSS and heap file usage; call it before pm_close, which may
+// delete heap files
+inline void pm_print_mem_stats() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    printf("Max RSS = %ld KB\n", usage.ru_maxrss);
+  int64_t bytes = pm_heap_file_bytes();
+  if (bytes >= 0)
+    printf("Heap file usage = %" PRId64 " KB\n", bytes / 1024);
+}
+
 #endif
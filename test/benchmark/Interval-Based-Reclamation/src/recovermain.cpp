@@ -0,0 +1,195 @@
+/*
+
+Copyright 2017 University of Rochester
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include "Harness.hpp"
+#include "CustomTests.hpp"
+#include "rideables/SortedUnorderedMap.hpp"
+#include "rideables/NatarajanTree.hpp"
+#include "rideables/LinkList.hpp"
+#include "trackers/AllocatorMacro.hpp"
+
+using namespace std;
+
+/*
+ * Crash-recovery benchmark.
+ *
+ * A child process builds the chosen rideable with <prefill> keys and keeps
+ * putting and removing keys until the parent SIGKILLs it at a random point
+ * up to <crash_ms> ms later. The parent then restarts the heap and recovers
+ * it with -t threads, and prints what RP_get_recovery_stats tells, which
+ * run_recovery.sh collects into CSV files. With -dcompact=1, the heap is
+ * recovered by RP_compact instead, which also moves blocks.
+ *
+ * usage: recovermain -r<rideable> -t<recovery threads> -dprefill=<N>
+ *                    [-dcrash_ms=<ms>] [-drange=<key range>] [-dseed=<seed>]
+ *                    [-dcompact=<0|1>]
+ *
+ * The heap "ibrrec" must not exist before a run.
+ */
+
+GlobalTestConfig* gtc;
+
+// record the tracer type of the root of each rideable before recovery
+static void register_root(int rideable){
+	switch(rideable){
+	case 0:
+		RP_get_root<SortedUnorderedMap<int,int,30000>>(1);
+		break;
+	case 1:
+		RP_get_root<LinkedList<int,int>>(2);
+		break;
+	case 2:
+		RP_get_root<NatarajanTree<int,int>>(3);
+		break;
+	}
+}
+
+static uint64_t env_or(const char* key, uint64_t dflt){
+	return gtc->checkEnv(key) ? strtoull(gtc->getEnv(key).c_str(), nullptr, 10) : dflt;
+}
+
+// build the heap, tell the parent through fd, and churn until killed
+static void crash_child(int fd, uint64_t prefill, uint64_t range, uint64_t seed){
+	if(PM_start("ibrrec")){
+		errexit("Heap ibrrec exists. Remove it before running recovermain.");
+	}
+	RUnorderedMap<int,int>* m = dynamic_cast<RUnorderedMap<int,int>*>(gtc->allocRideable());
+	if(!m){
+		errexit("recovermain must be run on RUnorderedMap<int,int> type object.");
+	}
+	std::mt19937_64 gen(seed);
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint64_t i = 0; i < prefill; i++){
+		int k = gen() % range;
+		m->insert(k, k, 0);
+	}
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::high_resolution_clock::now() - start);
+	std::cout << "Prefill time = " << duration.count() <<" ms."<<std::endl;
+
+	char c = 0;
+	if(write(fd, &c, 1) != 1){
+		errexit("Failed to notify the parent.");
+	}
+	close(fd);
+	while(true){
+		int k = gen() % range;
+		if(gen() % 2){
+			m->insert(k, k, 0);
+		} else {
+			m->remove(k, 0);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	gtc = new GlobalTestConfig(false);
+
+	// indexes of rideables are used by register_root
+	gtc->addRideableOption(new SortedUnorderedMapFactory<int,int>(), "SortedUnorderedMap (default)");
+	gtc->addRideableOption(new LinkListFactory<int,int>(), "LinkList");
+	gtc->addRideableOption(new NatarajanTreeFactory<int,int>(), "NatarajanTree");
+
+	// only to satisfy the harness; churn is driven by crash_child
+	gtc->addTestOption(new ObjRetireTest<int>(0,0,50,0,50,1000000), "crash recovery");
+
+	gtc->parseCommandLine(argc,argv);
+
+	uint64_t prefill = env_or("prefill", 1000000);
+	uint64_t range = env_or("range", prefill * 2);
+	uint64_t crash_ms = env_or("crash_ms", 1000);
+	bool compact = env_or("compact", 0) != 0;
+	uint64_t seed = env_or("seed",
+		std::chrono::system_clock::now().time_since_epoch().count());
+
+	if(gtc->verbose){
+		fprintf(stdout, "Testing:  recovery of %s with %d threads, prefill = %lu\n",
+		  gtc->getRideableName().c_str(), gtc->task_num, prefill);
+	}
+
+	signal(SIGSEGV, faultHandler);
+
+	int fds[2];
+	if(pipe(fds) != 0){
+		errexit("Failed to create pipe.");
+	}
+	pid_t pid = fork();
+	if(pid < 0){
+		errexit("Failed to fork.");
+	}
+	if(pid == 0){
+		close(fds[0]);
+		crash_child(fds[1], prefill, range, seed);
+	}
+	close(fds[1]);
+	char c;
+	if(read(fds[0], &c, 1) != 1){
+		errexit("Child exited before prefill finished.");
+	}
+	close(fds[0]);
+
+	// crash at a random point of the churn
+	std::mt19937_64 gen(seed + 1);
+	uint64_t delay = gen() % (crash_ms + 1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+	std::cout << "Crashed after " << delay << " ms of churn." << std::endl;
+
+	if(!PM_start("ibrrec")){
+		errexit("Heap ibrrec was not left by the crashed child.");
+	}
+	register_root(gtc->rideableType);
+	if(compact){
+		RP_compact(gtc->task_num);
+	} else {
+		RP_recover_threads(gtc->task_num);
+	}
+	RP_recovery_stats stats;
+	RP_get_recovery_stats(&stats);
+	printf("Reachable blocks = %lu\n", stats.reachable_blocks);
+	printf("Reachable bytes = %lu\n", stats.reachable_bytes);
+	printf("Reclaimed bytes = %lu\n", stats.reclaimed_bytes);
+	printf("Mark time = %.3f ms.\n", stats.mark_us / 1000.0);
+	printf("Sweep time = %.3f ms.\n", stats.sweep_us / 1000.0);
+	printf("Flush time = %.3f ms.\n", stats.flush_us / 1000.0);
+	printf("Recovery time = %.3f ms.\n", stats.total_us / 1000.0);
+	if(compact){
+		printf("Moved blocks = %lu\n", stats.moved_blocks);
+		printf("Moved bytes = %lu\n", stats.moved_bytes);
+		printf("Pinned blocks = %lu\n", stats.pinned_blocks);
+		printf("Released bytes = %lu\n", stats.released_bytes);
+		printf("Move time = %.3f ms.\n", stats.move_us / 1000.0);
+	}
+
+	PM_close();
+	return 0;
+}
@@ -131,8 +131,8 @@ public:
 template <class K, class V>
 class LinkListFactory : public RideableFactory{
 	LinkedList<K,V>* build(GlobalTestConfig* gtc){
-		if(gtc->restart && get_root(2) != nullptr) {
-			auto ret = reinterpret_cast<LinkedList<K,V>*>(get_root(2));
+		if(gtc->restart && RP_get_root<LinkedList<K,V>>(2) != nullptr) {
+			auto ret = reinterpret_cast<LinkedList<K,V>*>(RP_get_root<LinkedList<K,V>>(2));
 			ret->restart(gtc);
 			return ret;
 		} else {
@@ -145,12 +145,12 @@ class LinkListFactory : public RideableFactory{
 
 template<>
 inline void GarbageCollection::filter_func(LinkedList<int,int>* ptr) {
-	return mark_func(ptr->head.load());
+	return mark_field(ptr->head);
 }
 
 template<>
 inline void GarbageCollection::filter_func(LinkedList<int,int>::Node* ptr) {
-	return mark_func(ptr->next.load());
+	return mark_field(ptr->next);
 }
 
 #endif
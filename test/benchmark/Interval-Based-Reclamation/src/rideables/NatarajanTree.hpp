@@ -190,7 +190,7 @@ public:
 template <class K, class V> 
 class NatarajanTreeFactory : public RideableFactory{
 	NatarajanTree<K,V>* build(GlobalTestConfig* gtc){
-		if(get_root(3) == nullptr){
+		if(RP_get_root<NatarajanTree<K,V>>(3) == nullptr){
 			if(gtc->restart){
 				//dirty exit
 				PM_recover();
@@ -201,12 +201,12 @@ class NatarajanTreeFactory : public RideableFactory{
 		} else {
 			if(gtc->restart){
 				//dirty exit
-				NatarajanTree<K,V>* ret = reinterpret_cast<NatarajanTree<K,V>*>(get_root(3));
+				NatarajanTree<K,V>* ret = reinterpret_cast<NatarajanTree<K,V>*>(RP_get_root<NatarajanTree<K,V>>(3));
 				PM_recover();
 				ret->restart(gtc);
 				return ret;
 			} else {
-				NatarajanTree<K,V>* ret = reinterpret_cast<NatarajanTree<K,V>*>(get_root(3));
+				NatarajanTree<K,V>* ret = reinterpret_cast<NatarajanTree<K,V>*>(RP_get_root<NatarajanTree<K,V>>(3));
 				return ret;
 			}
 		}
@@ -670,14 +670,14 @@ void NatarajanTree<K,V>::doRangeQuery(Node& k1, Node& k2, int tid, Node* root, s
 
 template<>
 void GarbageCollection::filter_func(NatarajanTree<int,int>* ptr) {
-	NatarajanTree<int,int>::Node* curr = NatarajanTree<int,int>::getPtr(static_cast<NatarajanTree<int,int>::Node*>(ptr->r));
-	mark_func(curr);
+	mark_field(ptr->r);
 }
 
 template<>
 void GarbageCollection::filter_func(NatarajanTree<int,int>::Node* ptr) {
-	mark_func(NatarajanTree<int,int>::getPtr(ptr->left.load()));
-	mark_func(NatarajanTree<int,int>::getPtr(ptr->right.load()));
+	// tags are kept by marking and compaction as offsets into the node
+	mark_field(ptr->left);
+	mark_field(ptr->right);
 }
 
 // GC doesn't support std::string since std::string is allocated somewhere else
@@ -117,8 +117,8 @@ public:
 template <class K, class V> 
 class SortedUnorderedMapFactory : public RideableFactory{
 	SortedUnorderedMap<K,V,30000>* build(GlobalTestConfig* gtc){
-		if(gtc->restart && get_root(1) != nullptr) {
-			auto ret = reinterpret_cast<SortedUnorderedMap<K,V,30000>*>(get_root(1));
+		if(gtc->restart && RP_get_root<SortedUnorderedMap<K,V,30000>>(1) != nullptr) {
+			auto ret = reinterpret_cast<SortedUnorderedMap<K,V,30000>*>(RP_get_root<SortedUnorderedMap<K,V,30000>>(1));
 			ret->restart(gtc);
 			return ret;
 		} else {
@@ -327,24 +327,22 @@ bool SortedUnorderedMap<K,V,idxSize>::findNode(MarkPtr* &prev, Node* &cur, Node*
 template<>
 void GarbageCollection::filter_func(SortedUnorderedMap<int,int,30000>* ptr) {
 	for(int i=0; i < 30000; i++) {
-		SortedUnorderedMap<int,int,30000>::Node* curr = SortedUnorderedMap<int,int,30000>::getPtr(ptr->bucket[i].ui.ptr.load());
-		mark_func(curr);
+		mark_field(ptr->bucket[i].ui.ptr);
 	}
 }
 
 template<>
 void GarbageCollection::filter_func(SortedUnorderedMap<int,int,30000>::Node* ptr) {
-	mark_func(SortedUnorderedMap<int,int,30000>::getPtr(ptr->next.ptr.load()));
+	mark_field(ptr->next.ptr);
 }
 
 template<>
 void GarbageCollection::filter_func(SortedUnorderedMap<int,int,1>* ptr) {
-	SortedUnorderedMap<int,int,1>::Node* curr = SortedUnorderedMap<int,int,1>::getPtr(ptr->bucket[0].ui.ptr.load());
-	mark_func(curr);
+	mark_field(ptr->bucket[0].ui.ptr);
 }
 
 template<>
 void GarbageCollection::filter_func(SortedUnorderedMap<int,int,1>::Node* ptr) {
-	mark_func(SortedUnorderedMap<int,int,1>::getPtr(ptr->next.ptr.load()));
+	mark_field(ptr->next.ptr);
 }
 #endif
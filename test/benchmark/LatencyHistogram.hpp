@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+#ifndef LATENCY_HISTOGRAM
+#define LATENCY_HISTOGRAM
+
+/*
+ * Sampled latency of pm_malloc and pm_free.
+ *
+ * Each thread times one of every BENCH_LAT_SAMPLE (default 64, rounded up
+ * to a power of two; 0 disables it) calls of lat_malloc, and of lat_free, by
+ * TSC, and counts it in a log-bucketed histogram of its own: values below 16
+ * cycles have a bucket each, and larger ones have 16 buckets per power of
+ * two, so a bucket is within 1/16 of its values. Other calls cost a
+ * thread-local increment.
+ *
+ * lat_print merges histograms of all threads and prints p50, p99 and p99.9
+ * of each operation in ns, and writes the merged buckets to the csv file
+ * BENCH_LAT_HIST, if set.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include <mutex>
+#include <vector>
+
+#include "AllocatorMacro.hpp"
+
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+enum { LAT_MALLOC = 0, LAT_FREE, LAT_OP_NUM };
+static const char* lat_op_names[LAT_OP_NUM] = {"Malloc", "Free"};
+
+struct LatencyHistogram {
+  uint64_t counts[LAT_BUCKETS];
+
+  static inline int bucket(uint64_t v) {
+    if (v < (1ULL << LAT_SUB_BITS)) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) +
+      (int)((v >> shift) & ((1 << LAT_SUB_BITS) - 1));
+  }
+  // smallest value of bucket b
+  static inline uint64_t lowest(int b) {
+    if (b < (1 << LAT_SUB_BITS)) return b;
+    int shift = (b >> LAT_SUB_BITS) - 1;
+    return ((1ULL << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1))) << shift;
+  }
+  // largest value of bucket b
+  static inline uint64_t highest(int b) {
+    return b + 1 < LAT_BUCKETS ? lowest(b + 1) - 1 : UINT64_MAX;
+  }
+};
+
+// histograms of a thread, kept after it exits until lat_print
+struct LatencyRecorder {
+  // per operation, so that alternating calls don't time only one of them
+  uint64_t calls[LAT_OP_NUM] = {};
+  LatencyHistogram hist[LAT_OP_NUM] = {};
+};
+
+struct LatencyRecorders {
+  std::mutex mtx;
+  std::vector<LatencyRecorder*> all;
+};
+
+inline LatencyRecorders& lat_recorders() {
+  static LatencyRecorders recorders;
+  return recorders;
+}
+
+// mask of the call counter; a call is timed if its count & mask is 0
+inline uint64_t lat_compute_mask() {
+  const char* env = getenv("BENCH_LAT_SAMPLE");
+  uint64_t every = env ? strtoull(env, nullptr, 10) : 64;
+  if (every == 0) return UINT64_MAX;
+  uint64_t pow = 1;
+  while (pow < every) pow <<= 1;
+  return pow - 1;
+}
+
+inline uint64_t lat_mask() {
+  static const uint64_t mask = lat_compute_mask();
+  return mask;
+}
+
+inline LatencyRecorder* lat_recorder() {
+  static thread_local LatencyRecorder* rec = nullptr;
+  if (__builtin_expect(rec == nullptr, 0)) {
+    rec = new LatencyRecorder();
+    LatencyRecorders& r = lat_recorders();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    r.all.push_back(rec);
+  }
+  return rec;
+}
+
+// whether to time this call of op; never true if sampling is disabled
+inline bool lat_sampled(LatencyRecorder* rec, int op) {
+  uint64_t mask = lat_mask();
+  return (rec->calls[op]++ & mask) == 0 && mask != UINT64_MAX;
+}
+
+inline uint64_t lat_start() {
+  _mm_lfence();
+  return __rdtsc();
+}
+
+inline uint64_t lat_stop() {
+  unsigned int aux;
+  return __rdtscp(&aux);
+}
+
+inline void* lat_malloc(size_t s) {
+  LatencyRecorder* rec = lat_recorder();
+  if (!lat_sampled(rec, LAT_MALLOC)) return pm_malloc(s);
+  uint64_t start = lat_start();
+  void* ptr = pm_malloc(s);
+  uint64_t end = lat_stop();
+  rec->hist[LAT_MALLOC].counts[LatencyHistogram::bucket(end - start)]++;
+  return ptr;
+}
+
+inline void lat_free(void* p) {
+  LatencyRecorder* rec = lat_recorder();
+  if (!lat_sampled(rec, LAT_FREE)) {
+    pm_free(p);
+    return;
+  }
+  uint64_t start = lat_start();
+  pm_free(p);
+  uint64_t end = lat_stop();
+  rec->hist[LAT_FREE].counts[LatencyHistogram::bucket(end - start)]++;
+}
+
+// TSC cycles per ns, measured against the monotonic clock
+inline double lat_cycles_per_ns() {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t c0 = __rdtsc();
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+  } while ((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec) < 20000000LL);
+  uint64_t c1 = __rdtsc();
+  return (double)(c1 - c0) /
+    ((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+}
+
+// value in ns below which fraction p of samples in h fall, by bucket midpoint
+inline double lat_percentile(const LatencyHistogram& h, uint64_t total,
+    double p, double cycles_per_ns) {
+  uint64_t rank = (uint64_t)(p * total);
+  if (rank >= total) rank = total - 1;
+  uint64_t seen = 0;
+  for (int b = 0; b < LAT_BUCKETS; b++) {
+    seen += h.counts[b];
+    if (seen > rank) {
+      double mid = ((double)LatencyHistogram::lowest(b) +
+        (double)LatencyHistogram::highest(b)) / 2;
+      return mid / cycles_per_ns;
+    }
+  }
+  return 0;
+}
+
+// call it after all threads exit
+inline void lat_print() {
+  if (lat_mask() == UINT64_MAX) return;
+  LatencyHistogram merged[LAT_OP_NUM] = {};
+  LatencyRecorders& r = lat_recorders();
+  {
+    std::lock_guard<std::mutex> lk(r.mtx);
+    for (LatencyRecorder* rec : r.all) {
+      for (int op = 0; op < LAT_OP_NUM; op++) {
+        for (int b = 0; b < LAT_BUCKETS; b++)
+          merged[op].counts[b] += rec->hist[op].counts[b];
+      }
+    }
+  }
+  double cycles_per_ns = lat_cycles_per_ns();
+  const char* path = getenv("BENCH_LAT_HIST");
+  FILE* hist = path ? fopen(path, "w") : nullptr;
+  if (path && !hist)
+    fprintf(stderr, "can't open %s to write latency histograms\n", path);
+  if (hist)
+    fprintf(hist, "op,low_ns,high_ns,count\n");
+  for (int op = 0; op < LAT_OP_NUM; op++) {
+    uint64_t total = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+      total += merged[op].counts[b];
+      if (hist && merged[op].counts[b] != 0) {
+        fprintf(hist, "%s,%.1f,%.1f,%" PRIu64 "\n", lat_op_names[op],
+          LatencyHistogram::lowest(b) / cycles_per_ns,
+          LatencyHistogram::highest(b) / cycles_per_ns, merged[op].counts[b]);
+      }
+    }
+    if (total == 0) continue;
+    printf("%s latency p50/p99/p99.9 = %.0f/%.0f/%.0f ns\n", lat_op_names[op],
+      lat_percentile(merged[op], total, 0.5, cycles_per_ns),
+      lat_percentile(merged[op], total, 0.99, cycles_per_ns),
+      lat_percentile(merged[op], total, 0.999, cycles_per_ns));
+    printf("%s latency samples = %" PRIu64 "\n", lat_op_names[op], total);
+  }
+  if (hist)
+    fclose(hist);
+}
+
+#endif
@@ -56,6 +56,7 @@ void QueryPerformanceFrequency(long * x)
 #include <pthread.h>
 
 #include "AllocatorMacro.hpp"
+#include "LatencyHistogram.hpp"
 
 typedef void * VoidFunction (void *);
 void _beginthread (VoidFunction x, int, void * z)
@@ -216,6 +217,9 @@ int main (int argc, char *argv[])
 #ifdef _DEBUG
   _cputs("Hit any key to exit...") ;	(void)_getch() ;
 #endif
+  pm_print_pwb_stats();
+  lat_print();
+  pm_print_mem_stats();
   pm_close();
   return(0) ;
 
@@ -251,14 +255,14 @@ void runloops(long sleep_cnt, int num_chunks )
   while(TRUE){
     for( cblks=0; cblks<num_chunks; cblks++){
       victim = lran2(&rgen)%num_chunks ;
-      pm_free(blkp[victim]) ;
+      lat_free(blkp[victim]) ;
 
       if (max_size == min_size) {
 	blk_size = min_size;
       } else {
 	blk_size = min_size+lran2(&rgen)%(max_size - min_size) ;
       }
-      blkp[victim] = (char *) pm_malloc(blk_size) ;
+      blkp[victim] = (char *) lat_malloc(blk_size) ;
       blksize[victim] = blk_size ;
       assert(blkp[victim] != NULL) ;
     }
@@ -402,38 +406,13 @@ static void * exercise_heap( void *pinput)
   long          blk_size ;
   int           range ;
   int           threadno ;
-#ifdef THREAD_PINNING
-    int task_id;
-    int core_id;
-    cpu_set_t cpuset;
-    int set_result;
-    int get_result;
-#endif
 
   if( stopflag ) return 0;
 
   pdea = (thread_data *)pinput ;
   threadno = pdea->threadno;
 #ifdef THREAD_PINNING
-    CPU_ZERO(&cpuset);
-    task_id = threadno;
-    core_id = PINNING_MAP[task_id%80];
-    CPU_SET(core_id, &cpuset);
-    set_result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "setaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    get_result = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "getaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    if (!CPU_ISSET(core_id, &cpuset)){
-   	fprintf(stderr, "WARNING: thread aiming for cpu %d is pinned elsewhere.\n", core_id);	 
-    } else {
-    	// fprintf(stderr, "thread pinning on cpu %d succeeded.\n", core_id);
-    }
+    pm_pin_thread(threadno);
 #endif
   pdea->finished = FALSE ;
   pdea->cThreads++ ;
@@ -442,7 +421,7 @@ static void * exercise_heap( void *pinput)
   /* allocate NumBlocks chunks of random size */
   for( cblks=0; cblks<pdea->NumBlocks; cblks++){
     victim = lran2(&pdea->rgen)%pdea->asize ;
-    pm_free(pdea->array[victim]) ;
+    lat_free(pdea->array[victim]) ;
     pdea->cFrees++ ;
 
     if (range == 0) {
@@ -450,7 +429,7 @@ static void * exercise_heap( void *pinput)
     } else {
       blk_size = pdea->min_size+lran2(&pdea->rgen)%range ;
     }
-    pdea->array[victim] = (char *) pm_malloc(blk_size) ;
+    pdea->array[victim] = (char *) lat_malloc(blk_size) ;
 
     pdea->blksize[victim] = blk_size ;
     assert(pdea->array[victim] != NULL) ;
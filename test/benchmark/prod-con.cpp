@@ -24,6 +24,7 @@
 #include "MichaelScottQueue.hpp"
 
 #include "AllocatorMacro.hpp"
+#include "LatencyHistogram.hpp"
 
 // This class holds arguments to each thread.
 class workerArg {
@@ -48,37 +49,14 @@ void * producer (void * arg)
 {
 	workerArg& w1 = *(workerArg *) arg;
 #ifdef THREAD_PINNING
-    int task_id;
-    int core_id;
-    cpu_set_t cpuset;
-    int set_result;
-    int get_result;
-    CPU_ZERO(&cpuset);
-    task_id = w1.pairIdx*2;
-    core_id = PINNING_MAP[task_id%80];
-    CPU_SET(core_id, &cpuset);
-    set_result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "setaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    get_result = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "getaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    if (!CPU_ISSET(core_id, &cpuset)){
-   	fprintf(stderr, "WARNING: thread aiming for cpu %d is pinned elsewhere.\n", core_id);	 
-    } else {
-    	// fprintf(stderr, "thread pinning on cpu %d succeeded.\n", core_id);
-    }
+    pm_pin_thread(w1.pairIdx*2);
 #endif
 
 	// Producer: allocate objNum of objects in size of ObjSize, push each to msq
 	pthread_barrier_wait(&barrier);
 	for (int i = 0; i < w1.objNum; i++) {
 		// Allocate the object.
-		char * obj = (char*)pm_malloc(sizeof(char)*w1.objSize);
+		char * obj = (char*)lat_malloc(sizeof(char)*w1.objSize);
 		// Write into it
 		for (int k = 0; k < w1.objSize; k++) {
 			obj[k] = (char) k;
@@ -96,30 +74,7 @@ void * consumer (void * arg)
 	// Consumer: pop objects from msq, deallocate objNum of objects
 	workerArg& w1 = *(workerArg *) arg;
 #ifdef THREAD_PINNING
-    int task_id;
-    int core_id;
-    cpu_set_t cpuset;
-    int set_result;
-    int get_result;
-    CPU_ZERO(&cpuset);
-    task_id = w1.pairIdx*2+1;
-    core_id = PINNING_MAP[task_id%80];
-    CPU_SET(core_id, &cpuset);
-    set_result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "setaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    get_result = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "getaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    if (!CPU_ISSET(core_id, &cpuset)){
-   	fprintf(stderr, "WARNING: thread aiming for cpu %d is pinned elsewhere.\n", core_id);	 
-    } else {
-    	// fprintf(stderr, "thread pinning on cpu %d succeeded.\n", core_id);
-    }
+    pm_pin_thread(w1.pairIdx*2+1);
 #endif
 	int i = 0;
 	pthread_barrier_wait(&barrier);
@@ -128,7 +83,7 @@ void * consumer (void * arg)
 		auto obj = w1.msq->dequeue(1);
 		if(obj) {
 			// deallocate it if not null
-			pm_free(obj.value());
+			lat_free(obj.value());
 			i++;
 		}
 	}
@@ -183,6 +138,12 @@ int main (int argc, char * argv[]){
 	}
 	delete [] threads;
 	printf ("Time elapsed = %f seconds.\n", (double) t);
+	// each object is allocated by a producer and freed by a consumer
+	printf ("Throughput = %8.0f operations per second.\n",
+		2.0 * (objNum*2/nthreads) * (nthreads/2) / (double) t);
+	pm_print_pwb_stats();
+	lat_print();
+	pm_print_mem_stats();
 
 	pm_close();
 	return 0;
@@ -67,6 +67,7 @@ int thread_specific;
 #endif /* __cplusplus */
 
 #include "AllocatorMacro.hpp"
+#include "LatencyHistogram.hpp"
 
 #ifdef SILENT
 void fprintf_silent(FILE *, ...);
@@ -95,6 +96,7 @@ FILE *fout, *fin;
 unsigned uMaxBlockSize = 1000;
 unsigned uMinBlockSize = 1;
 unsigned long ulCallCount = 1000;
+uint64_t ullAllocCount = 0; /* blocks allocated by all threads, each freed once */
 
 unsigned long promptAndRead(char *msg, unsigned long defaultVal, char fmtCh);
 
@@ -125,6 +127,7 @@ int main(int argc, char *argv[])
 
 	uint64_t start_;
 	uint64_t end_;
+	struct timespec startWall, endWall;
 
 	setbuf(stdout, NULL);  /* turn off buffering for output */
 
@@ -159,6 +162,7 @@ int main(int argc, char *argv[])
 		startCPU = clock();
 		startTime = time(NULL);
 		start_ = rdtsc();
+		clock_gettime(CLOCK_MONOTONIC, &startWall);
 		for (i = 0;  i < uThreadCount;  i++){
 			threadArg[i] = i;
 			if (THREAD_EQ(tids[i] = 
@@ -174,6 +178,7 @@ int main(int argc, char *argv[])
 		free(threadArg);
 
 	end_ = rdtsc();
+	clock_gettime(CLOCK_MONOTONIC, &endWall);
 	elapsedTime = difftime(time(NULL), startTime);
 	cpuTime = (double)(clock()-startCPU) / (double)CLOCKS_PER_SEC;
 
@@ -185,6 +190,12 @@ int main(int argc, char *argv[])
 			  elapsedTime, cpuTime);
 
 	fprintf(fout, "\nrdtsc time: %f\n", ((double)end_ - (double)start_)/kCPUSpeed);
+	fprintf(fout, "Throughput = %8.0f operations per second.\n",
+			2.0 * ullAllocCount / ((endWall.tv_sec - startWall.tv_sec) +
+			(endWall.tv_nsec - startWall.tv_nsec) / 1e9));
+	pm_print_pwb_stats();
+	lat_print();
+	pm_print_mem_stats();
 
 	if (fin != stdin)
 		fclose(fin);
@@ -197,30 +208,7 @@ int main(int argc, char *argv[])
 void doBench(void *arg)
 { 
 #ifdef THREAD_PINNING
-    int task_id;
-    int core_id;
-    cpu_set_t cpuset;
-    int set_result;
-    int get_result;
-    CPU_ZERO(&cpuset);
-    task_id = *(int*)arg;
-    core_id = PINNING_MAP[task_id%80];
-    CPU_SET(core_id, &cpuset);
-    set_result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "setaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    get_result = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "getaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    if (!CPU_ISSET(core_id, &cpuset)){
-   	fprintf(stderr, "WARNING: thread aiming for cpu %d is pinned elsewhere.\n", core_id);	 
-    } else {
-    	// fprintf(stderr, "thread pinning on cpu %d succeeded.\n", core_id);
-    }
+    pm_pin_thread(*(int*)arg);
 	pthread_barrier_wait(&barrier);
 
 #endif
@@ -231,6 +219,7 @@ void doBench(void *arg)
 	char **mpe = memory + ulCallCount;
 	char **save_start = mpe;
 	char **save_end = mpe;
+	uint64_t allocs = 0;
 
 	while (repeat--){ 
 	for (size_base = uMinBlockSize;
@@ -250,11 +239,12 @@ void doBench(void *arg)
 				iterations *= 5;
 
 			while (iterations--){ 
-				if (!memory || !(*mp = (char *)pm_malloc(size))){
+				if (!memory || !(*mp = (char *)lat_malloc(size))){
 					printf("Out of memory\n");
 					_exit (1);
 				}
 				mp++;
+				allocs++;
 		/* while allocating skip over that portion of the buffer that still
 		 * holds pointers from the previous cycle
 		 */
@@ -274,13 +264,13 @@ void doBench(void *arg)
 			 * The top part is free in reverse order of allocation.
 			 */
 					while (mp < save_start){
-						pm_free (*mp);
+						lat_free (*mp);
 						mp++;
 					}
 					mp = mpe;
 					while (mp > save_end) {
 						mp--;
-						pm_free (*mp);
+						lat_free (*mp);
 					}
 					if(save_start == memory){
 						mp = save_end;
@@ -297,11 +287,12 @@ void doBench(void *arg)
 	mp = memory;
 
 	while (mp < mpe){
-		pm_free (*mp);
+		lat_free (*mp);
 		mp++;
 	}
 
 	pm_free(memory);
+	__sync_fetch_and_add(&ullAllocCount, allocs);
 }
 
 unsigned long promptAndRead(char *msg, unsigned long defaultVal, char fmtCh)
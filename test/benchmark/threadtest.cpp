@@ -40,6 +40,7 @@
 #include "fred.h"
 #include "timer.h"
 #include "AllocatorMacro.hpp"
+#include "LatencyHistogram.hpp"
 int niterations = 50;	// Default number of iterations.
 int nobjects = 30000;  // Default number of objects.
 int nthreads = 1;	// Default number of threads.
@@ -58,22 +59,22 @@ public:
   int y;
   void*
   operator new(std::size_t size) {
-    return pm_malloc(size);
+    return lat_malloc(size);
   }
 
   void*
   operator new[](std::size_t size) {
-    return pm_malloc(size);
+    return lat_malloc(size);
   }
 
   void
   operator delete(void *ptr) noexcept {
-    pm_free(ptr);
+    lat_free(ptr);
   }
 
   void
   operator delete[](void *ptr) noexcept {
-    pm_free(ptr);
+    lat_free(ptr);
   }
 };
 
@@ -82,30 +83,7 @@ public:
 extern "C" void * worker (void * arg)
 {
 #ifdef THREAD_PINNING
-    int task_id;
-    int core_id;
-    cpu_set_t cpuset;
-    int set_result;
-    int get_result;
-    CPU_ZERO(&cpuset);
-    task_id = *(int*)arg;
-    core_id = PINNING_MAP[task_id%80];
-    CPU_SET(core_id, &cpuset);
-    set_result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "setaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    get_result = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
-    if (set_result != 0){
-    	fprintf(stderr, "getaffinity failed for thread %d to cpu %d\n", task_id, core_id);
-	exit(1);
-    }
-    if (!CPU_ISSET(core_id, &cpuset)){
-   	fprintf(stderr, "WARNING: thread aiming for cpu %d is pinned elsewhere.\n", core_id);	 
-    } else {
-    	// fprintf(stderr, "thread pinning on cpu %d succeeded.\n", core_id);
-    }
+    pm_pin_thread(*(int*)arg);
 #endif
   int i, j;
   Foo ** a;
@@ -196,6 +174,12 @@ int main (int argc, char * argv[])
   t.stop ();
 
   printf( "Time elapsed = %f\n", (double) t);
+  // each object is allocated and freed once per iteration
+  printf ("Throughput = %8.0f operations per second.\n",
+    2.0 * nthreads * niterations * (nobjects / nthreads) / (double) t);
+  pm_print_pwb_stats();
+  lat_print();
+  pm_print_mem_stats();
 
   delete [] threads;
   pm_close();
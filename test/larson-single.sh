@@ -33,5 +33,11 @@ while read line; do
   fi
 done < /tmp/larson
 
-echo "{ \"threads\": $THREADS , \"ops\":  $ops , \"allocator\": $ALLOC}"
-echo "$THREADS,$ops,$ALLOC" >> larson.csv
+# persistence counters, NA if the allocator doesn't report them
+flushes=$(awk '/^Flushes =/ {print $3}' /tmp/larson)
+fences=$(awk '/^Fences =/ {print $3}' /tmp/larson)
+flushes=${flushes:-NA}
+fences=${fences:-NA}
+
+echo "{ \"threads\": $THREADS , \"ops\":  $ops , \"allocator\": $ALLOC , \"flushes\": $flushes , \"fences\": $fences }"
+echo "$THREADS,$ops,$ALLOC,$flushes,$fences" >> larson.csv
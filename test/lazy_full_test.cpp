@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+/*
+ * lazy_full_test: allocation right after RP_recover_lazy on a nearly full
+ * heap.
+ *
+ * A child fills all but a few superblocks with 1KB nodes, keeps only the
+ * first half of them reachable from root 0, and crashes. The parent then
+ * restarts with RP_recover_lazy and at once allocates a block of each of
+ * many size classes, each of which needs a superblock of its own before the
+ * background sweep has returned the garbage ones, and then many more small
+ * blocks. It then checks that the reachable list is intact.
+ *
+ * usage: lazy_full_test
+ *
+ * It exits with 1 on failure, otherwise 0.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <string>
+
+#include "ralloc.hpp"
+#include "pm_config.hpp"
+
+#define HEAP_ID "lazyfull"
+#define HEAP_SIZE MIN_SB_REGION_SIZE
+
+struct Node {
+    pptr<Node> next;
+    uint64_t id;
+    char pad[1024 - sizeof(pptr<Node>) - sizeof(uint64_t)];
+};
+
+template<>
+inline void GarbageCollection::filter_func(Node* ptr){
+    mark_func(static_cast<Node*>(ptr->next));
+}
+
+// nodes allocated before the crash, leaving a few sbs of the heap
+static const uint64_t NODE_NUM = (HEAP_SIZE / SBSIZE - 8) * (SBSIZE / sizeof(Node));
+// 64B blocks allocated after restart, needing about a quarter of the heap
+static const uint64_t SMALL_NUM = HEAP_SIZE / 64 / 4;
+
+static void remove_heap(){
+    const char* suffixes[] = {"_basemd", "_desc", "_sb", "_bitmap", "_ckpt"};
+    for(const char* s : suffixes) {
+        unlink((std::string(HEAPFILE_PREFIX) + HEAP_ID + s).c_str());
+    }
+}
+
+static void fill_and_crash(){
+    RP_init(HEAP_ID, HEAP_SIZE);
+    Node* head = nullptr;
+    for(uint64_t i = 0; i < NODE_NUM; i++) {
+        Node* n = (Node*)RP_malloc(sizeof(Node));
+        n->id = i;
+        // the second half is garbage
+        if(i < NODE_NUM / 2) {
+            n->next = head;
+            head = n;
+        }
+    }
+    RP_set_root(head, 0);
+    kill(getpid(), SIGKILL);
+}
+
+int main(){
+    remove_heap();
+    pid_t pid = fork();
+    if(pid == 0) fill_and_crash();
+    int status;
+    waitpid(pid, &status, 0);
+
+    RP_init(HEAP_ID, HEAP_SIZE);
+    Node* head = RP_get_root<Node>(0);
+    if(!RP_recover_lazy(0)) {
+        printf("FAILED: heap isn't dirty after crash\n");
+        return 1;
+    }
+    // more size classes than free sbs left
+    for(size_t sz = 16; sz <= 2048; sz += 16) {
+        if(RP_malloc(sz) == nullptr) {
+            printf("FAILED: out of space for a block of %lu bytes\n", sz);
+            return 1;
+        }
+    }
+    for(uint64_t i = 0; i < SMALL_NUM; i++) {
+        void* p = RP_malloc(64);
+        if(p == nullptr) {
+            printf("FAILED: out of space after %lu blocks\n", i);
+            return 1;
+        }
+        memset(p, 0, 64);
+    }
+    uint64_t count = 0;
+    uint64_t expect = NODE_NUM / 2;
+    for(Node* n = head; n != nullptr; n = n->next) {
+        if(n->id != --expect) break;
+        count++;
+    }
+    if(count != NODE_NUM / 2) {
+        printf("FAILED: %lu of %lu nodes reachable\n", count, NODE_NUM / 2);
+        return 1;
+    }
+    printf("passed\n");
+    RP_close();
+    remove_heap();
+    return 0;
+}
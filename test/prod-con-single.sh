@@ -33,5 +33,11 @@ while read line; do
   fi
 done < /tmp/prod-con
 
-echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC}"
-echo "$THREADS,$exec_time,$ALLOC" >> prod-con.csv
+# persistence counters, NA if the allocator doesn't report them
+flushes=$(awk '/^Flushes =/ {print $3}' /tmp/prod-con)
+fences=$(awk '/^Fences =/ {print $3}' /tmp/prod-con)
+flushes=${flushes:-NA}
+fences=${fences:-NA}
+
+echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC , \"flushes\": $flushes , \"fences\": $fences }"
+echo "$THREADS,$exec_time,$ALLOC,$flushes,$fences" >> prod-con.csv
@@ -11,7 +11,7 @@ echo $ARGS
 make clean
 make larson_test ${ARGS}
 rm -rf larson.csv
-echo "thread,ops,allocator" >> larson.csv
+echo "thread,ops,allocator,flushes,fences" >> larson.csv
 for i in {1..3}
 do
 	for threads in 1 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
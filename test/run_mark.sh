@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# time marking of a linked list and a tree after a crash with different
+# numbers of blocks prefetched ahead of tracing (0 is no prefetch).
+# runs where recovermain fails are reported and left out of the csv.
+
+# where the IBR build puts heap files, HEAPFILE_PREFIX of pm_config.hpp
+HEAPFILE_PREFIX=${HEAPFILE_PREFIX:-/pmem0/}
+
+make clean;make libralloc.a
+cd benchmark/Interval-Based-Reclamation; make clean;make;
+mkdir -p ../../../data/recovery
+rm -rf mark.csv
+echo "rideable,prefetch,threads,prefill,reachable_blocks,mark_time(ms)" >> mark.csv
+for i in {1..3}
+do
+	for RIDEABLE in 1 2
+	do
+		case $RIDEABLE in
+			1) NAME="LinkList";;
+			2) NAME="NatarajanTree";;
+		esac
+		for PREFETCH in 0 2 4 8 16
+		do
+			for THREADS in 1 4 16 48
+			do
+				PREFILL=4000000
+				rm -f ${HEAPFILE_PREFIX}ibrrec_*
+				if ! RALLOC_MARK_PREFETCH=$PREFETCH ./bin/recovermain -r$RIDEABLE -t$THREADS -dprefill=$PREFILL -dseed=$i > /tmp/mark; then
+					echo "recovermain failed: rideable $RIDEABLE prefetch $PREFETCH threads $THREADS" >&2
+					continue
+				fi
+				reachable=""; mark_time=""
+				while read line; do
+					if [[ $line == *"Reachable blocks"* ]]; then
+						reachable=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Mark time"* ]]; then
+						mark_time=$(echo $line | awk '{print $4}')
+					fi
+				done < /tmp/mark
+				if [[ -z $mark_time ]]; then
+					echo "no mark time: rideable $RIDEABLE prefetch $PREFETCH threads $THREADS" >&2
+					continue
+				fi
+				echo "$NAME,$PREFETCH,$THREADS,$PREFILL,$reachable,$mark_time" >> mark.csv
+			done
+		done
+	done
+done
+cp mark.csv ../../../data/recovery/mark.csv
+rm -f ${HEAPFILE_PREFIX}ibrrec_*
+cd -
@@ -11,7 +11,7 @@ echo $ARGS
 make clean
 make prod-con_test ${ARGS}
 rm -rf prod-con.csv
-echo "thread,exec_time,allocator" >> prod-con.csv
+echo "thread,exec_time,allocator,flushes,fences" >> prod-con.csv
 for i in {1..3}
 do
 	for threads in 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# crash the IBR rideables at a random point and time their recovery,
+# sweeping heap size and recovery threads. one csv per rideable.
+# runs where recovermain fails are reported and left out of the csv.
+
+# where the IBR build puts heap files, HEAPFILE_PREFIX of pm_config.hpp
+HEAPFILE_PREFIX=${HEAPFILE_PREFIX:-/pmem0/}
+
+make clean;make libralloc.a
+cd benchmark/Interval-Based-Reclamation; make clean;make;
+mkdir -p ../../../data/recovery
+for RIDEABLE in 0 1 2
+do
+	case $RIDEABLE in
+		0) NAME="SortedUnorderedMap";;
+		1) NAME="LinkList";;
+		2) NAME="NatarajanTree";;
+	esac
+	rm -rf recovery.csv
+	echo "prefill,threads,reachable_blocks,reachable_bytes,reclaimed_bytes,mark_time(ms),sweep_time(ms),flush_time(ms),recovery_time(ms)" >> recovery.csv
+	for i in {1..3}
+	do
+		for PREFILL in 1000000 2000000 4000000 8000000
+		do
+			for THREADS in 1 2 4 8 16 24 32 40 48
+			do
+				rm -f ${HEAPFILE_PREFIX}ibrrec_*
+				if ! ./bin/recovermain -r$RIDEABLE -t$THREADS -dprefill=$PREFILL > /tmp/recovery; then
+					echo "recovermain failed: rideable $RIDEABLE prefill $PREFILL threads $THREADS" >&2
+					continue
+				fi
+				reachable=""; reachable_bytes=""; reclaimed_bytes=""
+				mark_time=""; sweep_time=""; flush_time=""; recovery_time=""
+				while read line; do
+					if [[ $line == *"Mark time"* ]]; then
+						mark_time=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Sweep time"* ]]; then
+						sweep_time=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Flush time"* ]]; then
+						flush_time=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Reachable blocks"* ]]; then
+						reachable=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Reachable bytes"* ]]; then
+						reachable_bytes=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Reclaimed bytes"* ]]; then
+						reclaimed_bytes=$(echo $line | awk '{print $4}')
+					fi
+					if [[ $line == *"Recovery time"* ]]; then
+						recovery_time=$(echo $line | awk '{print $4}')
+					fi
+				done < /tmp/recovery
+				if [[ -z $recovery_time ]]; then
+					echo "no recovery time: rideable $RIDEABLE prefill $PREFILL threads $THREADS" >&2
+					continue
+				fi
+				echo "$PREFILL,$THREADS,$reachable,$reachable_bytes,$reclaimed_bytes,$mark_time,$sweep_time,$flush_time,$recovery_time" >> recovery.csv
+			done
+		done
+	done
+	cp recovery.csv ../../../data/recovery/recovery_${NAME}.csv
+done
+rm -f ${HEAPFILE_PREFIX}ibrrec_*
+cd -
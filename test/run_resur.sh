@@ -8,7 +8,7 @@ do
 	for MODE in {0..5}
 	do
 		rm -rf /dev/shm/*
-		./bin/intmain -r3 -m$MODE -i0 -v > /tmp/resur
+		RALLOC_VERBOSE=1 ./bin/intmain -r3 -m$MODE -i0 -v > /tmp/resur
 		while read line; do
 			if [[ $line == *"Prefill time"* ]]; then
 				prefill_time=$(echo $line | awk '{print $4}')
@@ -16,9 +16,9 @@ do
 			fi
 		done < /tmp/resur
 
-		./bin/intmain -r3 -m$MODE -i0 -v > /tmp/resur
+		RALLOC_VERBOSE=1 ./bin/intmain -r3 -m$MODE -i0 -v > /tmp/resur
 		while read line; do
-			if [[ $line == *"Time elapsed"* ]]; then
+			if [[ $line == *"ms on GC"* ]]; then
 				gc_time=$(echo $line | awk '{print $4}')
 			fi
 			if [[ $line == *"Reachable blocks"* ]]; then
@@ -11,7 +11,7 @@ echo $ARGS
 make clean
 make sh6bench_test ${ARGS}
 rm -rf shbench.csv
-echo "thread,exec_time,allocator" >> shbench.csv
+echo "thread,exec_time,allocator,flushes,fences" >> shbench.csv
 for i in {1..3}
 do
 	for threads in 1 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
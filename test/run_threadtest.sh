@@ -10,7 +10,7 @@ echo $ARGS
 make clean
 make threadtest_test ${ARGS}
 rm -rf threadtest.csv
-echo "thread,exec_time,allocator" >> threadtest.csv
+echo "thread,exec_time,allocator,flushes,fences" >> threadtest.csv
 for i in {1..3}
 do
 	for threads in 1 2 4 6 10 16 20 24 32 40 48 62 72 80 84 88
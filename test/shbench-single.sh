@@ -39,5 +39,11 @@ while read line; do
   fi
 done < /tmp/shbench
 
-echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC }"
-echo "$THREADS,$exec_time,$ALLOC" >> shbench.csv
+# persistence counters, NA if the allocator doesn't report them
+flushes=$(awk '/^Flushes =/ {print $3}' /tmp/shbench)
+fences=$(awk '/^Fences =/ {print $3}' /tmp/shbench)
+flushes=${flushes:-NA}
+fences=${fences:-NA}
+
+echo "{ \"threads\": $THREADS , \"time\":  $exec_time , \"allocator\": $ALLOC , \"flushes\": $flushes , \"fences\": $fences }"
+echo "$THREADS,$exec_time,$ALLOC,$flushes,$fences" >> shbench.csv
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2019 University of Rochester. All rights reserved.
+ * Licenced under the MIT licence. See LICENSE file in the project root for
+ * details.
+ */
+
+/*
+ * rpcheck: offline checker of a Ralloc heap.
+ *
+ * It maps the _basemd, _desc and _sb (and _bitmap) files of heap <id> and
+ * checks descriptors and anchors of all superblocks with RP_check, then
+ * prints free blocks per size class. With -r, a dirty heap is recovered by a
+ * conservative GC first, checked again, and written back as clean.
+ *
+ * Without -r, the heap files are left as they are: a dirty heap stays dirty.
+ * Don't run it while any process uses the heap.
+ *
+ * usage: rpcheck [-t threads] [-r] [-q] <id>
+ *      -t: threads to check and recover with, 0 (default) for all available
+ *      -r: recover a dirty heap and write it back
+ *      -q: don't print each inconsistency
+ *
+ * It exits with 1 if any inconsistency is found, otherwise 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include "ralloc.hpp"
+#include "pm_config.hpp"
+
+static void usage(const char* prog){
+    fprintf(stderr, "usage: %s [-t threads] [-r] [-q] <id>\n", prog);
+    exit(2);
+}
+
+static void print_report(const RP_check_report& report){
+    printf("Heap is %s.\n", report.dirty ? "dirty" : "clean");
+    printf("Superblocks: %lu in region, %lu free\n", report.sb_num, report.sb_free);
+    if(report.sc[0].block_num != 0) {
+        printf("Large blocks: %lu in %lu superblocks\n",
+            report.sc[0].block_num, report.sc[0].sb_num);
+    }
+    printf("%4s %10s %10s %12s %12s %8s\n",
+        "sc", "block_size", "sbs", "blocks", "free", "free(%)");
+    uint64_t block_bytes = 0;
+    uint64_t free_bytes = 0;
+    for(int sc = 1; sc < RP_SC_NUM; sc++) {
+        const RP_sc_usage& u = report.sc[sc];
+        if(u.sb_num == 0) continue;
+        printf("%4d %10u %10lu %12lu %12lu %8.2f\n", sc, u.block_size,
+            u.sb_num, u.block_num, u.free_num, 100.0 * u.free_num / u.block_num);
+        block_bytes += u.block_num * u.block_size;
+        free_bytes += u.free_num * u.block_size;
+    }
+    if(block_bytes != 0) {
+        printf("Small blocks: %lu KB, %lu KB free (%.2f%%)\n", block_bytes / 1024,
+            free_bytes / 1024, 100.0 * free_bytes / block_bytes);
+    }
+    if(report.dirty)
+        printf("Free blocks aren't known until the heap is recovered.\n");
+    printf("Inconsistencies: %lu\n", report.errors);
+}
+
+int main(int argc, char** argv){
+    int thread_num = 0;
+    bool repair = false;
+    bool quiet = false;
+    int opt;
+    while((opt = getopt(argc, argv, "t:rq")) != -1) {
+        switch(opt) {
+        case 't':
+            thread_num = atoi(optarg);
+            break;
+        case 'r':
+            repair = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1) usage(argv[0]);
+    const char* id = argv[optind];
+
+    // RP_init creates a heap that doesn't exist, and wants the size the
+    // heap was created with, which is the size of _sb but its metadata
+    std::string filepath = std::string(HEAPFILE_PREFIX) + id;
+    struct stat st;
+    if(stat((filepath + "_basemd").c_str(), &st) != 0 ||
+        stat((filepath + "_sb").c_str(), &st) != 0) {
+        fprintf(stderr, "Heap %s doesn't exist in %s.\n", id, HEAPFILE_PREFIX);
+        return 2;
+    }
+    RP_init(id, (uint64_t)st.st_size - 2 * PAGESIZE);
+    RP_set_verbose(quiet ? 0 : 1);
+
+    RP_check_report report;
+    int ret;
+    if(repair) {
+        // no root has a known type here, so all are traced conservatively
+        if(RP_recover_threads(thread_num)) {
+            RP_recovery_stats stats;
+            RP_get_recovery_stats(&stats);
+            printf("Recovered with %d threads in %.3f ms: %lu blocks reachable, %lu KB reclaimed\n",
+                stats.thread_num, stats.total_us / 1000.0, stats.reachable_blocks,
+                stats.reclaimed_bytes / 1024);
+        }
+        ret = RP_check(&report, thread_num);
+        print_report(report);
+        // written back as clean on exit
+        return ret;
+    }
+    ret = RP_check(&report, thread_num);
+    print_report(report);
+    // skip the write back on exit, so that a dirty heap stays dirty
+    fflush(stdout);
+    _exit(ret);
+}